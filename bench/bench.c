@@ -0,0 +1,193 @@
+/* bench.c
+ *
+ * $Id$
+ *
+ * Benchmark harness for scpwrap. Runs scpwrap with fakescp standing in for scp (using
+ * scpwrap's --command option), over a set of workloads and output modes, and reports:
+ *
+ *   lines/s     lines that fakescp wrote to stdout and stderr, per second of wall-clock time
+ *   cpu/1k      CPU milliseconds used by scpwrap per 1000 lines (excluding fakescp's own CPU time)
+ *   p50, p99    latency, in microseconds, from fakescp writing a progress line to the harness
+ *               reading the corresponding event from scpwrap's stdout
+ *
+ * Usage: bench [scpwrap [fakescp]]
+ *
+ * which defaults to "./scpwrap" and "bench/fakescp". Run it from "make bench".
+ *
+ * Latencies are only meaningful when scpwrap emits one event per progress line; the workloads
+ * below use unique progress lines and --max-rate 0, so that nothing is coalesced.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define READ_BUFSIZE 65536
+
+/** a workload that fakescp generates */
+struct workload {
+    char *name;
+    char *count;     // progress lines
+    char *rate;      // progress lines per second, or "0" for unthrottled
+    char *filenameLen;
+    char *noise;     // stderr line every n progress lines, or "0" for none
+    int utf8;
+};
+
+static struct workload WORKLOADS[] = {
+    { "burst",       "200000", "0",    "16", "0",   0 },
+    { "burst-noise", "200000", "0",    "16", "100", 0 },
+    { "burst-utf8",  "200000", "0",    "64", "100", 1 },
+    { "paced",       "5000",   "2000", "16", "100", 0 }
+};
+
+/** an output mode of scpwrap, and how to recognise progress events in its output */
+struct mode {
+    char *name;
+    char *option;          // scpwrap option, or NULL
+    char *progressPrefix;  // output lines starting with this are progress events
+};
+
+static struct mode MODES[] = {
+    { "text", NULL,     "" },
+    { "js",   "--js",   "sp.setProgress(" },
+    { "json", "--json", "{\"event\":\"progress\"" }
+};
+
+/** return the CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/** run one workload in one mode, and print a line of results */
+static void run(char *scpwrap, char *fakescp, struct workload *wl, struct mode *md) {
+    char tsFile[] = "/tmp/scpwrap-bench-XXXXXX";
+    char *args[32], buf[READ_BUFSIZE];
+    int nargs = 0, fds[2], status, atLineStart = 1, prefixLen = strlen(md->progressPrefix), prefixMatched = 0;
+    uint64_t *outTimes, *inTimes = NULL, start, end, t, cpuNs, fakeCpuNs, nin = 0, nout = 0, nlines = 0, i;
+    size_t maxOut = atol(wl->count) + 1;
+    struct rusage ru;
+    ssize_t n;
+    pid_t pid;
+    FILE *f;
+
+    int tsFd = mkstemp(tsFile);
+    if (tsFd == -1) { perror("mkstemp"); exit(1); }
+    close(tsFd);
+    outTimes = malloc(maxOut * sizeof(uint64_t));
+    if (outTimes == NULL) { perror("malloc"); exit(1); }
+
+    args[nargs++] = scpwrap;
+    if (md->option != NULL) { args[nargs++] = md->option; }
+    args[nargs++] = "--max-rate"; args[nargs++] = "0";
+    args[nargs++] = "--command"; args[nargs++] = fakescp;
+    args[nargs++] = "--";
+    args[nargs++] = "-n"; args[nargs++] = wl->count;
+    args[nargs++] = "-r"; args[nargs++] = wl->rate;
+    args[nargs++] = "-f"; args[nargs++] = wl->filenameLen;
+    args[nargs++] = "-e"; args[nargs++] = wl->noise;
+    if (wl->utf8) { args[nargs++] = "-u"; }
+    args[nargs++] = "-t"; args[nargs++] = tsFile;
+    args[nargs] = NULL;
+
+    if (pipe(fds) == -1) { perror("pipe"); exit(1); }
+    start = now_ns();
+    pid = fork();
+    if (pid == -1) { perror("fork"); exit(1); }
+    if (pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        execv(scpwrap, args);
+        perror(scpwrap);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    // every progress event in a read() is given the time of that read()
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+        t = now_ns();
+        for (i=0; i<(uint64_t) n; i++) {
+            if (atLineStart) { prefixMatched = 0; atLineStart = 0; }
+            if (prefixMatched >= 0 && prefixMatched < prefixLen) {
+                prefixMatched = buf[i] == md->progressPrefix[prefixMatched] ? prefixMatched + 1 : -1;
+            }
+            if (buf[i] == '\n') {
+                if (prefixMatched >= prefixLen && nout < maxOut) { outTimes[nout++] = t; }
+                atLineStart = 1;
+            }
+        }
+    }
+    end = now_ns();
+    close(fds[0]);
+    if (wait4(pid, &status, 0, &ru) == -1) { perror("wait4"); exit(1); }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: scpwrap exited with status %d\n", wl->name, status);
+        exit(1);
+    }
+
+    // the rusage of scpwrap includes fakescp, which it has waited for
+    f = fopen(tsFile, "r");
+    if (f == NULL) { perror(tsFile); exit(1); }
+    inTimes = malloc((maxOut + 1) * sizeof(uint64_t));
+    if (inTimes == NULL) { perror("malloc"); exit(1); }
+    if (fread(&fakeCpuNs, sizeof(uint64_t), 1, f) != 1 || fread(&nin, sizeof(uint64_t), 1, f) != 1 ||
+        nin > maxOut || fread(inTimes, sizeof(uint64_t), nin, f) != nin) {
+        fprintf(stderr, "%s: could not read %s\n", wl->name, tsFile);
+        exit(1);
+    }
+    fclose(f);
+    unlink(tsFile);
+    cpuNs = (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 +
+        (uint64_t) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+    cpuNs = cpuNs > fakeCpuNs ? cpuNs - fakeCpuNs : 0;
+    nlines = nin + (atol(wl->noise) > 0 ? nin / atol(wl->noise) : 0);
+
+    // text mode also counts the trailing newline fakescp writes as a progress event
+    if (nout > nin) { nout = nin; }
+    if (nout != nin) {
+        fprintf(stderr, "%s/%s: %lu progress lines written, %lu events read; latencies are approximate\n",
+            md->name, wl->name, (unsigned long) nin, (unsigned long) nout);
+    }
+    for (i=0; i<nout; i++) {
+        inTimes[i] = outTimes[i] > inTimes[i] ? outTimes[i] - inTimes[i] : 0;
+    }
+    qsort(inTimes, nout, sizeof(uint64_t), compare_u64);
+
+    printf("%-6s %-12s %10.0f %10.2f %10.1f %10.1f\n", md->name, wl->name,
+        nlines / ((end - start) / 1e9),
+        nlines == 0 ? 0 : cpuNs / 1e6 / (nlines / 1000.0),
+        nout == 0 ? 0 : inTimes[nout / 2] / 1e3,
+        nout == 0 ? 0 : inTimes[nout * 99 / 100] / 1e3);
+    fflush(stdout);
+    free(inTimes);
+    free(outTimes);
+}
+
+int main(int argc, char **argv) {
+    char *scpwrap = argc > 1 ? argv[1] : "./scpwrap";
+    char *fakescp = argc > 2 ? argv[2] : "bench/fakescp";
+    size_t i, j;
+
+    printf("%-6s %-12s %10s %10s %10s %10s\n", "mode", "workload", "lines/s", "cpu/1k ms", "p50 us", "p99 us");
+    for (i=0; i<sizeof(MODES)/sizeof(MODES[0]); i++) {
+        for (j=0; j<sizeof(WORKLOADS)/sizeof(WORKLOADS[0]); j++) {
+            run(scpwrap, fakescp, &WORKLOADS[j], &MODES[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/* fakescp.c
+ *
+ * $Id$
+ *
+ * Stand-in for scp which generates progress meter output without copying anything,
+ * used to benchmark scpwrap (see bench.c). Run it from scpwrap using
+ * "scpwrap --command fakescp -- [options]".
+ *
+ * Options are:
+ *   -n count   number of progress lines to write (default 10000)
+ *   -r rate    progress lines per second, or 0 to write them as fast as possible (default 0)
+ *   -f len     length of the filename in each progress line (default 16)
+ *   -e n       write a line of text to stderr after every n progress lines, or 0 for none (default 0)
+ *   -u         include non-ASCII (UTF-8) characters in filenames and stderr text
+ *   -t file    write the CLOCK_MONOTONIC time of each progress line to file, in nanoseconds
+ *
+ * The timestamp file contains 64-bit unsigned integers in native byte order: the CPU time
+ * used by this process (user + system, in nanoseconds), the number of progress lines, and
+ * then the time that each progress line was written.
+ *
+ * Unlike scp, which starts each progress line with a '\r', each line here ends with a '\r',
+ * so that scpwrap can process it as soon as it is written rather than when the next line
+ * arrives; otherwise the time between lines would be included in the latency measurement.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/** return the CLOCK_MONOTONIC time in nanoseconds */
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** write all of buf to fd */
+static void write_all(int fd, const char *buf, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n <= 0) { perror("write"); exit(1); }
+        buf += n; len -= n;
+    }
+}
+
+int main(int argc, char **argv) {
+    long count = 10000, noise = 0, i;
+    double rate = 0;
+    int filenameLen = 16, utf8 = 0, c;
+    char *tsFile = NULL;
+    char *filename, line[4096];
+    uint64_t *times, start, next;
+    struct rusage ru;
+    int len;
+
+    while ((c = getopt(argc, argv, "n:r:f:e:ut:")) != -1) {
+        switch (c) {
+            case 'n': count = atol(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'f': filenameLen = atoi(optarg); break;
+            case 'e': noise = atol(optarg); break;
+            case 'u': utf8 = 1; break;
+            case 't': tsFile = optarg; break;
+            default:
+                fprintf(stderr, "usage: fakescp [-n count] [-r rate] [-f len] [-e n] [-u] [-t file]\n");
+                exit(1);
+        }
+    }
+    if (filenameLen < 1 || filenameLen > 1024) { fprintf(stderr, "-f must be between 1 and 1024\n"); exit(1); }
+
+    // filename is "file-" followed by 'x's, or by "é" characters if -u is used
+    filename = malloc(filenameLen + 1);
+    times = malloc((count + 2) * sizeof(uint64_t));
+    if (filename == NULL || times == NULL) { perror("malloc"); exit(1); }
+    for (i=0; i<filenameLen; i++) {
+        if (i < 5) { filename[i] = "file-"[i]; }
+        else if (utf8 && i + 1 < filenameLen) { filename[i++] = '\xc3'; filename[i] = '\xa9'; }
+        else { filename[i] = 'x'; }
+    }
+    filename[filenameLen] = 0;
+
+    start = next = now_ns();
+    for (i=0; i<count; i++) {
+        if (rate > 0) {
+            struct timespec ts;
+            next = start + (uint64_t) (i * 1e9 / rate);
+            ts.tv_sec = next / 1000000000; ts.tv_nsec = next % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+        // the transfer size increases with every line, so that scpwrap never drops a line as unchanged
+        len = snprintf(line, sizeof(line), "%s%s %3ld%% %6ldKB %5.1fMB/s   %02ld:%02ld ETA\r",
+            i == 0 ? "\r" : "", filename, i * 100 / count, i, 2.1, (count - i) / 60 % 60, (count - i) % 60);
+        times[i + 2] = now_ns();
+        write_all(STDOUT_FILENO, line, len);
+        if (noise > 0 && (i + 1) % noise == 0) {
+            len = snprintf(line, sizeof(line), "%s banner \"line\" %ld\tof noise\n", utf8 ? "caf\xc3\xa9 \xe2\x9c\x93" : "plain", i);
+            write_all(STDERR_FILENO, line, len);
+        }
+    }
+    write_all(STDOUT_FILENO, "\n", 1);
+
+    if (tsFile != NULL) {
+        FILE *f = fopen(tsFile, "w");
+        if (f == NULL) { perror(tsFile); exit(1); }
+        getrusage(RUSAGE_SELF, &ru);
+        times[0] = (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000 +
+            (uint64_t) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+        times[1] = count;
+        fwrite(times, sizeof(uint64_t), count + 2, f);
+        fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,922 @@
+/* libscpwrap.c
+ *
+ * $Id$
+ *
+ * Line framing, progress meter parsing, templates and escaping for scpwrap, and for
+ * other programs that want to parse the output of scp themselves; see libscpwrap.h.
+ *
+ * The scpwrap command is a client of this library; everything to do with where the 
+ * events go (the output queue, --listen, --board, --record etc) is in scpwrap.c.
+ */
+
+#define _GNU_SOURCE                // for memmem()
+#include <unistd.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pty.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "libscpwrap.h"
+
+// initial size of the stdout/stderr capture buffers. Lines longer than this will
+// grow the buffer; if we get more than SCPWRAP_LINE_MAXSIZE bytes on stdout/stderr 
+// without a newline, then they will be split into more than one event
+#define STDERR_BUFSIZE 4096
+#define STDOUT_BUFSIZE 4096
+
+// don't bother calling read() with less than this many bytes free in a capture buffer;
+// compact or grow the buffer first
+#define READ_MINSIZE 512
+
+// alignment of allocations from an arena
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/** a block of memory taken from the heap by an arena. The block's data follows the 
+   header, at an offset of ARENA_HEADER bytes */
+struct scpwrap_arena_block {
+    struct scpwrap_arena_block *next;
+    size_t size;                    // bytes of data in the block
+    int own;                        // set to 1 if the block holds a single large allocation
+};
+#define ARENA_HEADER ARENA_ROUND(sizeof(struct scpwrap_arena_block))
+#define ARENA_DATA(b) ((char *) (b) + ARENA_HEADER)
+
+/** initialise an arena */
+void scpwrap_arena_init(struct scpwrap_arena *a) {
+    memset(a, 0, sizeof(struct scpwrap_arena));
+}
+
+/** take a block with room for size bytes from the heap. returns NULL if it couldn't be allocated */
+static struct scpwrap_arena_block *arena_block(struct scpwrap_arena *a, size_t size, int own) {
+    struct scpwrap_arena_block *b = malloc(ARENA_HEADER + size);
+    a->heapCalls++;
+    if (b == NULL) { return NULL; }
+    a->heapBytes += ARENA_HEADER + size;
+    b->size = size;
+    b->own = own;
+    return b;
+}
+
+/** allocate n bytes from an arena; see libscpwrap.h */
+void *scpwrap_arena_alloc(struct scpwrap_arena *a, size_t n) {
+    struct scpwrap_arena_block *b;
+    n = n == 0 ? ARENA_ALIGN : ARENA_ROUND(n);
+    if (a->blocks != NULL && a->used + n <= a->blocks->size) {
+        a->used += n;
+        return ARENA_DATA(a->blocks) + a->used - n;
+    }
+    if (n > SCPWRAP_ARENA_BLOCKSIZE / 4) {
+        // a block of its own, after the one being carved up (so that isn't wasted)
+        if ((b = arena_block(a, n, 1)) == NULL) { return NULL; }
+        if (a->blocks == NULL) {
+            b->next = NULL; a->blocks = b; a->used = n;
+        } else {
+            b->next = a->blocks->next; a->blocks->next = b;
+        }
+        return ARENA_DATA(b);
+    }
+    if ((b = arena_block(a, SCPWRAP_ARENA_BLOCKSIZE - ARENA_HEADER, 0)) == NULL) { return NULL; }
+    b->next = a->blocks;
+    a->blocks = b;
+    a->used = n;
+    return ARENA_DATA(b);
+}
+
+/** resize an allocation from an arena; see libscpwrap.h */
+void *scpwrap_arena_grow(struct scpwrap_arena *a, void *p, size_t oldSize, size_t newSize) {
+    struct scpwrap_arena_block *b, *nb, **prev;
+    size_t oldRound = ARENA_ROUND(oldSize), newRound = ARENA_ROUND(newSize);
+    void *q;
+    if (p == NULL) { return scpwrap_arena_alloc(a, newSize); }
+    if (newRound <= oldRound) { return p; }
+    // the last allocation carved from the current block can be extended while there's room
+    b = a->blocks;
+    if (b != NULL && !b->own && (char *) p + oldRound == ARENA_DATA(b) + a->used && a->used - oldRound + newRound <= b->size) {
+        a->used += newRound - oldRound;
+        return p;
+    }
+    // an allocation with a block of its own is reallocated along with its block
+    for (prev = &a->blocks; (b = *prev) != NULL; prev = &b->next) {
+        if (!b->own || ARENA_DATA(b) != (char *) p) { continue; }
+        nb = realloc(b, ARENA_HEADER + newRound);
+        a->heapCalls++;
+        if (nb == NULL) { return NULL; }
+        a->heapBytes += newRound - nb->size;
+        nb->size = newRound;
+        *prev = nb;
+        if (nb == a->blocks) { a->used = newRound; }
+        return ARENA_DATA(nb);
+    }
+    // otherwise the old allocation is left in its block until the arena is freed
+    if ((q = scpwrap_arena_alloc(a, newSize)) == NULL) { return NULL; }
+    memcpy(q, p, oldSize);
+    return q;
+}
+
+/** copy a string into an arena; see libscpwrap.h */
+char *scpwrap_arena_strndup(struct scpwrap_arena *a, const char *str, size_t n) {
+    char *p = scpwrap_arena_alloc(a, n + 1);
+    if (p == NULL) { return NULL; }
+    memcpy(p, str, n);
+    p[n] = 0;
+    return p;
+}
+
+/** free everything allocated from an arena. The heap counters are kept */
+void scpwrap_arena_free(struct scpwrap_arena *a) {
+    struct scpwrap_arena_block *b, *next;
+    for (b = a->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    a->blocks = NULL;
+    a->used = 0;
+}
+
+/** allocate size bytes from arena, or from the heap if arena is NULL */
+static void *arena_or_heap_alloc(struct scpwrap_arena *arena, size_t size) {
+    return arena != NULL ? scpwrap_arena_alloc(arena, size) : malloc(size);
+}
+
+/** resize an allocation from arena, or from the heap if arena is NULL */
+static void *arena_or_heap_grow(struct scpwrap_arena *arena, void *p, size_t oldSize, size_t newSize) {
+    return arena != NULL ? scpwrap_arena_grow(arena, p, oldSize, newSize) : realloc(p, newSize);
+}
+
+/** return a pointer to the first '\r' or '\n' within the n bytes starting at p,
+   or NULL if there isn't one */
+static char *find_eol(char *p, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask) { return p + i + __builtin_ctz(mask); }
+    }
+#endif
+    for (; i < n; i++) {
+        if (p[i]=='\r' || p[i]=='\n') { return p + i; }
+    }
+    return NULL;
+}
+
+/** put back the byte that was replaced by a NUL terminator in framer_next() */
+static void framer_unhold(struct scpwrap_framer *fr) {
+    if (fr->held != -1) { fr->buf[fr->start] = (char) fr->held; fr->held = -1; }
+}
+
+/** move any partial line to the start of the buffer, and grow the buffer if there's
+   not much room left after it. returns the number of bytes that can be added after
+   fr->end, which is 0 if the partial line has reached SCPWRAP_LINE_MAXSIZE (but 
+   framer_next() will have split it, so that can only happen if it hasn't been called) */
+static size_t framer_reserve(struct scpwrap_framer *fr, struct scpwrap_arena *arena) {
+    framer_unhold(fr);
+    if (fr->start > 0) {
+        memmove(fr->buf, fr->buf + fr->start, fr->end - fr->start);
+        fr->end -= fr->start; fr->scan -= fr->start; fr->start = 0;
+    }
+    if (fr->size - fr->end - 1 < READ_MINSIZE && fr->size < SCPWRAP_LINE_MAXSIZE) {
+        size_t newSize = fr->size * 2 > SCPWRAP_LINE_MAXSIZE ? SCPWRAP_LINE_MAXSIZE : fr->size * 2;
+        char *newBuf = arena_or_heap_grow(arena, fr->buf, fr->size, newSize);
+        if (newBuf != NULL) { fr->buf = newBuf; fr->size = newSize; }
+    }
+    return fr->size - fr->end - 1;
+}
+
+/** return the next complete line read by the framer, or NULL if there isn't one yet.
+
+   The line is NUL-terminated in place, and remains valid until the next call to
+   framer_next() or framer_reserve(). The length of the line (including its '\r' or
+   '\n' terminator) is stored in *len. Once the output has been closed, any
+   unterminated text remaining in the buffer is returned as the final line.
+ */
+static char *framer_next(struct scpwrap_framer *fr, size_t *len) {
+    char *line, *eol;
+    framer_unhold(fr);
+    eol = find_eol(fr->buf + fr->scan, fr->end - fr->scan);
+    if (eol == NULL) {
+        fr->scan = fr->end;
+        if (fr->start == fr->end) { return NULL; }
+        if (!fr->eof && fr->end - fr->start < SCPWRAP_LINE_MAXSIZE - 1) { return NULL; }
+        eol = fr->buf + fr->end - 1;
+    }
+    line = fr->buf + fr->start;
+    *len = eol + 1 - line;
+    fr->start = fr->scan = eol + 1 - fr->buf;
+    fr->held = (unsigned char) fr->buf[fr->start];
+    fr->buf[fr->start] = 0;
+    return line;
+}
+
+/** initialise an output buffer.
+   returns 0 on success, or -1 if the buffer could not be allocated */
+int scpwrap_outbuf_init(struct scpwrap_outbuf *ob, struct scpwrap_arena *arena, size_t size) {
+    ob->arena = arena;
+    ob->buf = arena_or_heap_alloc(arena, size);
+    ob->len = 0;
+    ob->size = size;
+    return ob->buf == NULL ? -1 : 0;
+}
+
+/** ensure there's room for at least n more bytes in the output buffer */
+void scpwrap_outbuf_reserve(struct scpwrap_outbuf *ob, size_t n) {
+    if (ob->len + n > ob->size) {
+        size_t newSize = ob->size * 2;
+        while (newSize < ob->len + n) { newSize *= 2; }
+        ob->buf = arena_or_heap_grow(ob->arena, ob->buf, ob->size, newSize);
+        if (ob->buf == NULL) { perror("realloc"); exit(1); }
+        ob->size = newSize;
+    }
+}
+
+/** append n bytes to the output buffer */
+void scpwrap_outbuf_append(struct scpwrap_outbuf *ob, const char *str, size_t n) {
+    scpwrap_outbuf_reserve(ob, n);
+    memcpy(ob->buf + ob->len, str, n);
+    ob->len += n;
+}
+
+/** free an output buffer */
+void scpwrap_outbuf_free(struct scpwrap_outbuf *ob) {
+    if (ob->arena == NULL) { free(ob->buf); }
+    ob->buf = NULL;
+    ob->len = ob->size = 0;
+}
+
+/** short escapes for ASCII characters in javascript and JSON strings, indexed by
+   character. 0 means the character can be output as-is, 'u' means it is output as
+   a "\u00XX" escape, anything else is output after a backslash.
+ */
+static const char JS_ESCAPES[128] = {
+    ['\0']='u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'v', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"']='"', ['\'']='\'', ['\\']='\\', [0x7f]='u'
+};
+static const char JSON_ESCAPES[128] = {
+    ['\0']='u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"']='"', ['\\']='\\', [0x7f]='u'
+};
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+/** return the number of bytes at the start of str that can be output without escaping;
+   i.e. printable ASCII other than '"', '\\' and (if quote is '\'') the single-quote character */
+static size_t escape_span(const unsigned char *str, size_t n, const char *escapes, char quote) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // NB: signed comparison, so bytes >= 0x80 are also less than 0x20
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i squote = _mm_set1_epi8(quote);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (str + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, dquote), _mm_cmpeq_epi8(v, squote)),
+                _mm_cmpeq_epi8(v, backslash)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) { return i + __builtin_ctz(mask); }
+    }
+#endif
+    for (; i < n; i++) {
+        if (str[i] >= 0x80 || escapes[str[i]] != 0) { return i; }
+    }
+    return i;
+}
+
+/** append a "\uXXXX" escape for a UTF-16 code unit to the output buffer. 
+   The buffer must have room for 6 more bytes */
+static void escape_u16(struct scpwrap_outbuf *ob, unsigned int cu) {
+    char *p = ob->buf + ob->len;
+    p[0] = '\\'; p[1] = 'u'; 
+    p[2] = HEX_DIGITS[(cu >> 12) & 0xf]; p[3] = HEX_DIGITS[(cu >> 8) & 0xf];
+    p[4] = HEX_DIGITS[(cu >> 4) & 0xf];  p[5] = HEX_DIGITS[cu & 0xf];
+    ob->len += 6;
+}
+
+/** decode the UTF-8 sequence at the start of str. 
+   returns the length of the sequence and stores the code point in *cp, or returns 0 
+   if str doesn't start with a valid (shortest-form, non-surrogate) UTF-8 sequence */
+static size_t utf8_decode(const unsigned char *str, size_t n, unsigned int *cp) {
+    unsigned int c = str[0];
+    if (c >= 0xc2 && c <= 0xdf) {
+        if (n < 2 || (str[1] & 0xc0) != 0x80) { return 0; }
+        *cp = ((c & 0x1f) << 6) | (str[1] & 0x3f);
+        return 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        if (n < 3 || (str[1] & 0xc0) != 0x80 || (str[2] & 0xc0) != 0x80 ||
+            (c == 0xe0 && str[1] < 0xa0) || (c == 0xed && str[1] > 0x9f)) { return 0; }
+        *cp = ((c & 0x0f) << 12) | ((str[1] & 0x3f) << 6) | (str[2] & 0x3f);
+        return 3;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        if (n < 4 || (str[1] & 0xc0) != 0x80 || (str[2] & 0xc0) != 0x80 || (str[3] & 0xc0) != 0x80 ||
+            (c == 0xf0 && str[1] < 0x90) || (c == 0xf4 && str[1] > 0x8f)) { return 0; }
+        *cp = ((c & 0x07) << 18) | ((str[1] & 0x3f) << 12) | ((str[2] & 0x3f) << 6) | (str[3] & 0x3f);
+        return 4;
+    }
+    return 0;
+}
+
+/** convert text to a javascript or JSON string escape (depending on mode), appending 
+   the result to the output buffer.
+
+   Runs of printable ASCII are copied as-is. Control characters use short escapes 
+   where possible, or "\u00XX" otherwise; UTF-8 sequences are decoded into "\uXXXX" 
+   escapes (or surrogate pairs for characters outside the BMP). Bytes that are not
+   part of a valid UTF-8 sequence are treated as ISO-8859-1.
+
+    see http://rishida.net/tools/conversion
+ */ 
+void scpwrap_escape_append(struct scpwrap_outbuf *ob, int mode, const char *text, size_t n) {
+    const unsigned char *str = (const unsigned char *) text;
+    const char *escapes = mode == SCPWRAP_ESCAPE_JSON ? JSON_ESCAPES : JS_ESCAPES;
+    char quote = mode == SCPWRAP_ESCAPE_JSON ? '"' : '\'';
+    size_t i = 0, run, seqLen;
+    unsigned int cp;
+
+    while (i < n) {
+        run = escape_span(str + i, n - i, escapes, quote);
+        if (run > 0) {
+            scpwrap_outbuf_append(ob, text + i, run);
+            i += run;
+            if (i == n) { break; }
+        }
+        // worst case is a surrogate pair
+        scpwrap_outbuf_reserve(ob, 12);
+        if (str[i] < 0x80) {
+            char esc = escapes[str[i]];
+            if (esc == 'u') {
+                escape_u16(ob, str[i]);
+            } else {
+                ob->buf[ob->len++] = '\\';
+                ob->buf[ob->len++] = esc;
+            }
+            i++;
+        } else if ((seqLen = utf8_decode(str + i, n - i, &cp)) > 0) {
+            if (cp > 0xffff) {
+                cp -= 0x10000;
+                escape_u16(ob, 0xd800 | (cp >> 10));
+                escape_u16(ob, 0xdc00 | (cp & 0x3ff));
+            } else {
+                escape_u16(ob, cp);
+            }
+            i += seqLen;
+        } else {
+            escape_u16(ob, str[i]);
+            i++;
+        }
+    }
+}
+
+/** Compile a template string supplied on the command-line.
+
+   Placeholders in the form "%x" are converted into references to the n'th field
+   supplied to scpwrap_template_render(), where x is the n'th character in the placeholders 
+   string; e.g. with placeholders "fp", "%f" refers to the first field and "%p" the 
+   second. 
+
+   C-like escapes ("\n", "\t" etc) in the template are converted into their appropriate
+   character. Any other '%' sequences are treated as literal text, except for placeholders
+   in reserved (i.e. those that are only valid in other templates), which are reported 
+   as errors.
+
+   When the template is rendered, fields are escaped according to escapeMode.
+
+   The compiled template is allocated from arena, or the heap if arena is NULL.
+
+   returns 0 on success, or -1 if the template is invalid (an error message is 
+   sent to stderr)
+ */
+int scpwrap_template_compile(struct scpwrap_template *t, struct scpwrap_arena *arena, const char *name, 
+    const char *src, const char *placeholders, const char *reserved, int escapeMode) {
+    size_t srcLen = strlen(src), textLen = 0, i;
+    const char *ph;
+    int maxSpans = 1;
+
+    for (i=0; i<srcLen; i++) {
+        if (src[i]=='%') { maxSpans += 2; }
+    }
+    t->name = name;
+    t->escapeMode = escapeMode;
+    t->arena = arena;
+    t->text = arena_or_heap_alloc(arena, srcLen + 1);
+    t->spans = arena_or_heap_alloc(arena, maxSpans * sizeof(struct scpwrap_span));
+    t->nspans = 0;
+    t->fieldMask = 0;
+    if (t->text == NULL || t->spans == NULL) { perror("malloc"); exit(1); }
+
+    for (i=0; i<srcLen; i++) {
+        if (src[i]=='\\') {
+            if (++i == srcLen) {
+                fprintf(stderr, "Invalid %s: incomplete escape at end of template\n", name);
+                return -1;
+            }
+            switch (src[i]) {
+                case 'n': t->text[textLen++] = '\n'; break;
+                case 'r': t->text[textLen++] = '\r'; break;
+                case 't': t->text[textLen++] = '\t'; break;
+                default: /* unknown escape, just use character */ t->text[textLen++] = src[i];
+            }
+        } else if (src[i]=='%' && i+1 < srcLen && (ph = strchr(placeholders, src[i+1])) != NULL) {
+            if (t->nspans > 0 && t->spans[t->nspans-1].field == -1) {
+                t->spans[t->nspans-1].len = textLen - t->spans[t->nspans-1].off;
+            }
+            t->spans[t->nspans].field = ph - placeholders;
+            t->fieldMask |= 1u << (ph - placeholders);
+            t->spans[t->nspans].off = t->spans[t->nspans].len = 0;
+            t->nspans++;
+            i++;
+            continue;
+        } else if (src[i]=='%' && i+1 < srcLen && strchr(reserved, src[i+1]) != NULL) {
+            fprintf(stderr, "Invalid %s: the %%%c placeholder cannot be used in this template\n", name, src[i+1]);
+            return -1;
+        } else {
+            t->text[textLen++] = src[i];
+        }
+        // start a new literal span if the previous span was a placeholder
+        if (t->nspans == 0 || t->spans[t->nspans-1].field != -1) {
+            t->spans[t->nspans].field = -1;
+            t->spans[t->nspans].off = textLen - 1;
+            t->nspans++;
+        }
+    }
+    if (t->nspans > 0 && t->spans[t->nspans-1].field == -1) {
+        t->spans[t->nspans-1].len = textLen - t->spans[t->nspans-1].off;
+    }
+    t->text[textLen] = 0;
+    return 0;
+}
+
+/** Render a compiled template into the output buffer, replacing each placeholder 
+   with the corresponding field.
+
+   if the template's escapeMode is SCPWRAP_ESCAPE_JS or SCPWRAP_ESCAPE_JSON, then values in the fields will 
+     be Javascript- or JSON-escaped (i.e. the character '\n' will be converted to the two-character "\n" escape) 
+ */  
+void scpwrap_template_render(struct scpwrap_outbuf *ob, const struct scpwrap_template *t, const struct scpwrap_field *fields) {
+    int i;
+    const struct scpwrap_span *sp;
+    for (i=0, sp=t->spans; i<t->nspans; i++, sp++) {
+        if (sp->field == -1) {
+            scpwrap_outbuf_append(ob, t->text + sp->off, sp->len);
+        } else if (t->escapeMode != SCPWRAP_ESCAPE_NONE) { 
+            scpwrap_escape_append(ob, t->escapeMode, fields[sp->field].str, fields[sp->field].len); 
+        } else { 
+            scpwrap_outbuf_append(ob, fields[sp->field].str, fields[sp->field].len); 
+        }
+    }
+}
+
+/** free a compiled template */
+void scpwrap_template_free(struct scpwrap_template *t) {
+    if (t->arena == NULL) { free(t->text); free(t->spans); }
+    t->text = NULL;
+    t->spans = NULL;
+    t->nspans = 0;
+}
+
+/** convert a size or speed from a progress line (e.g. "2112KB", "2.1MB/s", "0.00kB/s", 
+   "45.6M", "102MiB/s" or "12") into a number of bytes (or bytes per second) */
+double scpwrap_parse_size(const char *str) {
+    static const char units[] = "KMGTPE";
+    char *end;
+    const char *unit;
+    double n = strtod(str, &end);
+    if (*end != 0 && (unit = strchr(units, *end == 'k' ? 'K' : *end)) != NULL) {
+        n *= pow(1024, unit - units + 1);
+    }
+    return n;
+}
+
+/** Progress meter parsers (--parser).
+
+   Each line of the output containing the progress meter (stdout for scp and rsync, 
+   stderr for curl and pv) is passed to a parser, which splits it into tokens with
+   tokenize(); these point into the line in the framer's buffer, so nothing is copied. 
+   Only once the parser has decided that the line is a progress line does it 
+   NUL-terminate the fields it uses in place, as the line is otherwise emitted as text.
+
+   The fields are normalised in that the percent is always an integer, and the bytes
+   and rate are always converted to numbers (for %B, %R, etc), but the transfer size, 
+   speed and ETA text are as displayed by the program being run.
+ */
+
+/** split a line into at most max tokens separated by spaces or line terminators.
+   returns the number of tokens stored in tok */
+static int tokenize(const char *line, size_t len, struct scpwrap_field *tok, int max) {
+    const char *end = line + len;
+    int n = 0;
+    while (n < max) {
+        while (line < end && (*line==' ' || *line=='\r' || *line=='\n')) { line++; }
+        if (line == end) { break; }
+        tok[n].str = line;
+        while (line < end && *line!=' ' && *line!='\r' && *line!='\n') { line++; }
+        tok[n].len = line - tok[n].str;
+        n++;
+    }
+    return n;
+}
+
+/** NUL-terminate a token in the line it was found in */
+static void token_terminate(char *line, const struct scpwrap_field *tok) {
+    line[tok->str - line + tok->len] = 0;
+}
+
+/** returns 1 if a token ends with the character c */
+static int token_ends(const struct scpwrap_field *tok, char c) {
+    return tok->len > 0 && tok->str[tok->len - 1] == c;
+}
+
+/** returns 1 if a token is a number of digits (and commas, if commas is set) */
+static int token_digits(const struct scpwrap_field *tok, int commas) {
+    size_t i;
+    for (i=0; i<tok->len; i++) {
+        if (!(tok->str[i] >= '0' && tok->str[i] <= '9') && !(commas && tok->str[i] == ',')) { return 0; }
+    }
+    return tok->len > 0;
+}
+
+/** set the filename field to the name in the parser state */
+static void parser_name(struct scpwrap_parse_state *ps, struct scpwrap_progress *p) {
+    p->fv[SCPWRAP_FIELD_FILENAME].str = ps->nameLen == 0 ? "" : ps->name;
+    p->fv[SCPWRAP_FIELD_FILENAME].len = ps->nameLen;
+}
+
+/** set the name in the parser state */
+static void parser_set_name(struct scpwrap_parse_state *ps, const char *name, size_t len) {
+    size_t size;
+    if (len >= ps->nameSize) {
+        // grow geometrically; an arena can't extend a block in place, so each growth leaves the old copy behind
+        size = ps->nameSize * 2 > len + 1 ? ps->nameSize * 2 : len + 1;
+        ps->name = arena_or_heap_grow(ps->arena, ps->name, ps->nameSize, size);
+        if (ps->name == NULL) { perror("realloc"); exit(1); }
+        ps->nameSize = size;
+    }
+    memcpy(ps->name, name, len);
+    ps->name[len] = 0;
+    ps->nameLen = len;
+}
+
+/** reset the parser state when a process is started with arguments args. Progress meters
+   that don't include a filename use the last part of the last argument that isn't an 
+   option (e.g. the URL or file being copied) */
+static void parser_start(struct scpwrap_parse_state *ps, char **args) {
+    const char *name = "", *slash;
+    int i;
+    for (i=1; args != NULL && args[i] != NULL; i++) {
+        if (args[i][0] != '-') { name = args[i]; }
+    }
+    // ignore any trailing slashes in URLs and directories
+    slash = name + strlen(name);
+    while (slash > name && slash[-1] == '/') { slash--; }
+    i = slash - name;
+    while (slash > name && slash[-1] != '/') { slash--; }
+    parser_set_name(ps, slash, name + i - slash);
+}
+
+/** parse a line of scp output; returns 1 if it's a progress line, otherwise 0 */
+static int parse_scp(struct scpwrap_parse_state *ps, char *line, size_t len, struct scpwrap_progress *p) {
+    struct scpwrap_field *fv = p->fv;
+    int i;
+    (void) ps;  // scp progress lines contain the filename
+    // something.tar.gz                                1% 2112KB   2.1MB/s   00:50 ETA
+    if (tokenize(line, len, fv, SCPWRAP_PROGRESS_FIELDS) != SCPWRAP_PROGRESS_FIELDS || !token_ends(&fv[SCPWRAP_FIELD_PERCENT], '%')) { 
+        return 0; 
+    }
+    fv[SCPWRAP_FIELD_PERCENT].len--;
+    for (i=0; i<SCPWRAP_PROGRESS_FIELDS; i++) { token_terminate(line, &fv[i]); }
+    p->bytes = scpwrap_parse_size(fv[SCPWRAP_FIELD_BYTES].str);
+    p->rate = scpwrap_parse_size(fv[SCPWRAP_FIELD_SPEED].str);
+    return 1;
+}
+
+/** parse a line of "rsync --progress" output. The name of each file is on a line of 
+   its own before its progress lines, so any line that isn't a progress line is kept 
+   as the name of the next file. returns 1 if it's a progress line, otherwise 0 */
+static int parse_rsync(struct scpwrap_parse_state *ps, char *line, size_t len, struct scpwrap_progress *p) {
+    struct scpwrap_field tok[4];
+    double n;
+    size_t i;
+    //      1,238,099  45%  146.38MB/s    0:00:08 (xfr#1, to-chk=0/1)
+    if (tokenize(line, len, tok, 4) != 4 || !token_ends(&tok[1], '%') || !token_ends(&tok[2], 's') ||
+        memchr(tok[3].str, ':', tok[3].len) == NULL) {
+        while (len > 0 && (line[len-1]=='\r' || line[len-1]=='\n')) { len--; }
+        if (len > 0) { parser_set_name(ps, line, len); }
+        return 0;
+    }
+    parser_name(ps, p);
+    p->fv[SCPWRAP_FIELD_PERCENT] = tok[1];
+    p->fv[SCPWRAP_FIELD_PERCENT].len--;
+    p->fv[SCPWRAP_FIELD_BYTES] = tok[0];
+    p->fv[SCPWRAP_FIELD_SPEED] = tok[2];
+    p->fv[SCPWRAP_FIELD_ETA] = tok[3];
+    for (i=1; i<SCPWRAP_PROGRESS_FIELDS; i++) { token_terminate(line, &p->fv[i]); }
+    // sizes have thousands separators, unless --human-readable is used
+    if (token_digits(&tok[0], 1)) {
+        for (i=0, n=0; i<tok[0].len; i++) {
+            if (tok[0].str[i] != ',') { n = n * 10 + (tok[0].str[i] - '0'); }
+        }
+        p->bytes = n;
+    } else {
+        p->bytes = scpwrap_parse_size(tok[0].str);
+    }
+    p->rate = scpwrap_parse_size(tok[2].str);
+    return 1;
+}
+
+/** parse a line of curl's progress meter (which is written to stderr). returns 1 if it's
+   a progress line, -1 if it's the meter's heading, otherwise 0 */
+static int parse_curl(struct scpwrap_parse_state *ps, char *line, size_t len, struct scpwrap_progress *p) {
+    struct scpwrap_field tok[12];
+    int n, i, upload;
+    //   % Total    % Received % Xferd  Average Speed   Time    Time     Time  Current
+    //                                  Dload  Upload   Total   Spent    Left  Speed
+    //  45  100M   45 45.6M    0     0  12.3M      0  0:00:08  0:00:03  0:00:05 12.4M
+    n = tokenize(line, len, tok, 12);
+    if (n > 0 && ((tok[0].len == 1 && tok[0].str[0] == '%') || (tok[0].len == 5 && memcmp(tok[0].str, "Dload", 5) == 0))) {
+        return -1;
+    }
+    if (n != 12 || !token_digits(&tok[0], 0) || !token_digits(&tok[2], 0) || !token_digits(&tok[4], 0) ||
+        memchr(tok[10].str, ':', tok[10].len) == NULL) {
+        return 0;
+    }
+    // use the amount sent if nothing's being received
+    upload = tok[3].len == 1 && tok[3].str[0] == '0';
+    parser_name(ps, p);
+    p->fv[SCPWRAP_FIELD_PERCENT] = tok[0];
+    p->fv[SCPWRAP_FIELD_BYTES] = tok[upload ? 5 : 3];
+    p->fv[SCPWRAP_FIELD_SPEED] = tok[11];
+    p->fv[SCPWRAP_FIELD_ETA] = tok[10];
+    for (i=1; i<SCPWRAP_PROGRESS_FIELDS; i++) { token_terminate(line, &p->fv[i]); }
+    p->bytes = scpwrap_parse_size(p->fv[SCPWRAP_FIELD_BYTES].str);
+    p->rate = scpwrap_parse_size(p->fv[SCPWRAP_FIELD_SPEED].str);
+    return 1;
+}
+
+/** parse a line of pv's progress meter (which is written to stderr, and only if it's a
+   terminal, unless pv's -f option is used). Only lines with a percentage (i.e. where pv 
+   knows the size) are progress lines. returns 1 if it's a progress line, otherwise 0 */
+static int parse_pv(struct scpwrap_parse_state *ps, char *line, size_t len, struct scpwrap_progress *p) {
+    struct scpwrap_field tok[16], *percent = NULL, *speed = NULL, *eta = NULL;
+    int n, i;
+    // 1.00GiB 0:00:10 [ 102MiB/s] [=========>         ] 50% ETA 0:00:10
+    n = tokenize(line, len, tok, 16);
+    if (n < 3 || !(tok[0].str[0] >= '0' && tok[0].str[0] <= '9')) { return 0; }
+    for (i=1; i<n; i++) {
+        if (speed == NULL && tok[i].len > 2 && memmem(tok[i].str, tok[i].len, "/s", 2) != NULL) { 
+            speed = &tok[i];
+        } else if (token_ends(&tok[i], '%') && tok[i].len > 1 && tok[i].str[0] >= '0' && tok[i].str[0] <= '9') {
+            percent = &tok[i];
+        } else if (tok[i].len == 3 && memcmp(tok[i].str, "ETA", 3) == 0 && i + 1 < n) {
+            eta = &tok[++i];
+        }
+    }
+    if (speed == NULL || percent == NULL) { return 0; }
+    if (speed->str[0] == '[') { speed->str++; speed->len--; }
+    if (token_ends(speed, ']')) { speed->len--; }
+    parser_name(ps, p);
+    p->fv[SCPWRAP_FIELD_PERCENT] = *percent;
+    p->fv[SCPWRAP_FIELD_PERCENT].len--;
+    p->fv[SCPWRAP_FIELD_BYTES] = tok[0];
+    p->fv[SCPWRAP_FIELD_SPEED] = *speed;
+    // pv removes the ETA when it's finished
+    if (eta != NULL) { p->fv[SCPWRAP_FIELD_ETA] = *eta; } else { p->fv[SCPWRAP_FIELD_ETA].str = "--:--"; p->fv[SCPWRAP_FIELD_ETA].len = 5; }
+    for (i=1; i<SCPWRAP_PROGRESS_FIELDS - (eta == NULL); i++) { token_terminate(line, &p->fv[i]); }
+    p->bytes = scpwrap_parse_size(tok[0].str);
+    p->rate = scpwrap_parse_size(p->fv[SCPWRAP_FIELD_SPEED].str);
+    return 1;
+}
+
+static const struct scpwrap_parser PARSERS[] = {
+    { "scp",   0, parse_scp },
+    { "rsync", 0, parse_rsync },
+    { "curl",  1, parse_curl },
+    { "pv",    1, parse_pv }
+};
+
+/** return the parser with the given name, or NULL if there isn't one */
+const struct scpwrap_parser *scpwrap_parser_find(const char *name) {
+    size_t i;
+    for (i=0; i<sizeof(PARSERS)/sizeof(PARSERS[0]); i++) {
+        if (strcmp(PARSERS[i].name, name) == 0) { return &PARSERS[i]; }
+    }
+    return NULL;
+}
+
+/** convert an ETA from a progress line (e.g. "05:23", "1:05:23" or "--:--") 
+   into a number of seconds, or -1 if it's not known */
+double scpwrap_parse_eta(const char *str) {
+    double eta = 0;
+    char *end;
+    do {
+        long n = strtol(str, &end, 10);
+        if (end == str) { return -1; }
+        eta = eta * 60 + n;
+        str = end + 1;
+    } while (*end == ':');
+    return eta;
+}
+
+/** returns 1 if a line is a blank line (i.e. just a line terminator) */
+static int blank_line(const char *line, size_t len) {
+    return len==1 && (line[0]=='\n' || line[0]=='\r');
+}
+
+/** parse a line of a stream's stdout (if isStderr is 0) or stderr (if isStderr is 1), and
+   call back with the event for it.
+
+   Lines of the output containing the progress meter are passed to the parser; anything 
+   other than a progress line there (e.g. the newline scp prints after each file) ends 
+   the current file. Blank lines on stdout, or in the progress meter output, aren't 
+   emitted as text, as scp prints them between files. */
+static void stream_line(struct scpwrap_stream *s, int isStderr, char *line, size_t len) {
+    struct scpwrap_progress p;
+    struct scpwrap_event ev;
+    int result = 0;
+
+    s->lines++;
+    ev.isStderr = isStderr;
+    ev.endsFile = isStderr == s->parser->isStderr;
+    ev.text = NULL;
+    ev.len = 0;
+    ev.progress = NULL;
+    if (ev.endsFile) {
+        result = s->parser->parse(&s->ps, line, len, &p);
+        if (result == -1) { return; }
+    }
+    if (result == 1) {
+        ev.type = SCPWRAP_EVENT_PROGRESS;
+        ev.endsFile = 0;
+        ev.progress = &p;
+    } else if ((ev.endsFile || !isStderr) && blank_line(line, len)) {
+        if (!ev.endsFile) { return; }
+        ev.type = SCPWRAP_EVENT_END_OF_FILE;
+    } else {
+        ev.type = SCPWRAP_EVENT_TEXT;
+        ev.text = line;
+        ev.len = len;
+    }
+    s->callback(s->ctx, &ev);
+}
+
+/** call back with an event for each complete line in a stream's stdout or stderr framer */
+static void stream_lines(struct scpwrap_stream *s, int isStderr) {
+    struct scpwrap_framer *fr = &s->framers[isStderr];
+    char *line;
+    size_t len;
+    while ((line = framer_next(fr, &len)) != NULL) {
+        stream_line(s, isStderr, line, len);
+    }
+}
+
+/** initialise a stream's stdout and stderr framers, and parser.
+   returns 0 on success, or -1 if the buffers could not be allocated */
+int scpwrap_stream_init(struct scpwrap_stream *s, struct scpwrap_arena *arena,
+    const struct scpwrap_parser *parser, scpwrap_callback callback, void *ctx) {
+    memset(s, 0, sizeof(struct scpwrap_stream));
+    s->arena = s->ps.arena = arena;
+    s->parser = parser;
+    s->callback = callback;
+    s->ctx = ctx;
+    s->framers[0].buf = arena_or_heap_alloc(arena, STDOUT_BUFSIZE);
+    s->framers[0].size = STDOUT_BUFSIZE;
+    s->framers[1].buf = arena_or_heap_alloc(arena, STDERR_BUFSIZE);
+    s->framers[1].size = STDERR_BUFSIZE;
+    if (s->framers[0].buf == NULL || s->framers[1].buf == NULL) { 
+        scpwrap_stream_free(s); 
+        return -1;
+    }
+    scpwrap_stream_start(s, NULL);
+    return 0;
+}
+
+/** reset a stream for the output of another process. The existing buffers are reused */
+void scpwrap_stream_start(struct scpwrap_stream *s, char **args) {
+    int i;
+    for (i=0; i<2; i++) {
+        struct scpwrap_framer *fr = &s->framers[i];
+        fr->start = fr->end = fr->scan = 0;
+        fr->held = -1;
+        fr->eof = 0;
+    }
+    parser_start(&s->ps, args);
+}
+
+/** return where to place more output; see libscpwrap.h */
+char *scpwrap_stream_space(struct scpwrap_stream *s, int isStderr, size_t *avail) {
+    struct scpwrap_framer *fr = &s->framers[isStderr];
+    *avail = framer_reserve(fr, s->arena);
+    return fr->buf + fr->end;
+}
+
+/** process n bytes placed at scpwrap_stream_space() */
+void scpwrap_stream_push(struct scpwrap_stream *s, int isStderr, size_t n) {
+    s->framers[isStderr].end += n;
+    stream_lines(s, isStderr);
+}
+
+/** copy output into the stream, in as many pieces as there's room for */
+void scpwrap_stream_feed(struct scpwrap_stream *s, int isStderr, const char *data, size_t len) {
+    size_t avail;
+    char *p;
+    while (len > 0) {
+        p = scpwrap_stream_space(s, isStderr, &avail);
+        if (avail > len) { avail = len; }
+        memcpy(p, data, avail);
+        scpwrap_stream_push(s, isStderr, avail);
+        data += avail;
+        len -= avail;
+    }
+}
+
+/** read as much data as is currently available on fd (up to the room in the framer), 
+   and process it.
+
+   returns the number of bytes read, 0 if the file descriptor has been closed
+   (or returned an error; the stream is closed in both cases), or -1 if no data
+   was available.
+ */
+ssize_t scpwrap_stream_read(struct scpwrap_stream *s, int isStderr, int fd) {
+    size_t avail;
+    char *p = scpwrap_stream_space(s, isStderr, &avail);
+    ssize_t n = read(fd, p, avail);
+    if (n > 0) {
+        scpwrap_stream_push(s, isStderr, n);
+        return n;
+    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return -1;
+    }
+    // NB: reading the master side of a pty returns EIO once the child has gone
+    scpwrap_stream_close(s, isStderr);
+    return 0;
+}
+
+/** mark stdout or stderr as closed; any unterminated text is returned as a final line */
+void scpwrap_stream_close(struct scpwrap_stream *s, int isStderr) {
+    if (s->framers[isStderr].eof) { return; }
+    s->framers[isStderr].eof = 1;
+    stream_lines(s, isStderr);
+}
+
+/** returns 1 if both stdout and stderr have been closed */
+int scpwrap_stream_closed(const struct scpwrap_stream *s) {
+    return s->framers[0].eof && s->framers[1].eof;
+}
+
+/** free a stream's buffers */
+void scpwrap_stream_free(struct scpwrap_stream *s) {
+    if (s->arena == NULL) {
+        free(s->framers[0].buf);
+        free(s->framers[1].buf);
+        free(s->ps.name);
+    }
+    s->framers[0].buf = s->framers[1].buf = s->ps.name = NULL;
+    s->ps.nameLen = s->ps.nameSize = 0;
+}
+
+/** start a process with stdout on a pseudoterminal and stderr on a pipe.
+   returns the pid of the process, or -1 if it couldn't be started */
+pid_t scpwrap_spawn(char **args, int *stdoutFd, int *stderrFd) {
+    int stderrPipeFd[2];              // pipe used to read stderr
+    pid_t pid;
+
+    // create pipe for stderr
+    if (pipe(stderrPipeFd) == -1) { perror("pipe"); return -1; }
+   
+    // get a pseudoterminal
+    pid = forkpty (stdoutFd, NULL, NULL, NULL);
+    if (pid == 0) {
+        /* CHILD */
+        close(stderrPipeFd[0]);    // close reading end in the child
+        // dup2(stderrPipeFd[1], 1);  // send stdout to the pipe (unused; stdout is the pseudoterminal fd)
+        dup2(stderrPipeFd[1], 2);  // send stderr to the pipe
+        close(stderrPipeFd[1]);    // this descriptor is no longer needed
+        execvp(args[0], args);
+        perror("execvp");
+        _exit (2);
+    } else if (pid == -1) {
+        /* ERROR */
+        perror("forkpty");
+        close(stderrPipeFd[0]); close(stderrPipeFd[1]);
+        return -1;
+    }
+
+    /* PARENT */
+    close(stderrPipeFd[1]);  // close the write end of the pipe in the parent
+    *stderrFd = stderrPipeFd[0];
+    fcntl(*stdoutFd, F_SETFL, fcntl(*stdoutFd, F_GETFL) | O_NONBLOCK);
+    fcntl(*stderrFd, F_SETFL, fcntl(*stderrFd, F_GETFL) | O_NONBLOCK);
+    return pid;
+}
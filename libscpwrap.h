@@ -0,0 +1,306 @@
+/* libscpwrap.h
+ *
+ * $Id$
+ *
+ * The line framing, progress meter parsing, template and escaping code used by scpwrap,
+ * as a library for programs that run scp (or rsync, curl or pv) themselves and want
+ * its progress as structured events, rather than running scpwrap and parsing its output.
+ *
+ * Output from a process is pushed into a scpwrap_stream as it's read; the stream splits
+ * it into lines, parses them with a scpwrap_parser, and calls back with an event for
+ * each line. The program owns the file descriptors and the event loop; it can use
+ * scpwrap_spawn() to start the process, or any other way of getting its output. Events
+ * point into the stream's buffers, so nothing is allocated per event; they're only
+ * valid until the callback returns.
+ *
+ * Streams, templates and output buffers can be allocated from a scpwrap_arena, which
+ * takes memory from the heap in large blocks and frees it all at once; or from the heap
+ * (one allocation per buffer), if the arena passed to their init function is NULL.
+ * Either way, buffers only grow until they're large enough for the longest line, so
+ * once a stream is running, parsing and rendering don't allocate anything.
+ *
+ *   static void on_event(void *ctx, const struct scpwrap_event *ev) {
+ *       if (ev->type == SCPWRAP_EVENT_PROGRESS) {
+ *           printf("%s %s%%\n", ev->progress->fv[SCPWRAP_FIELD_FILENAME].str,
+ *               ev->progress->fv[SCPWRAP_FIELD_PERCENT].str);
+ *       }
+ *   }
+ *
+ *   struct scpwrap_stream s;
+ *   int stdoutFd, stderrFd;
+ *   scpwrap_stream_init(&s, NULL, scpwrap_parser_find("scp"), on_event, NULL);
+ *   scpwrap_stream_start(&s, args);
+ *   pid = scpwrap_spawn(args, &stdoutFd, &stderrFd);
+ *   ... when stdoutFd is readable:  scpwrap_stream_read(&s, 0, stdoutFd);
+ *   ... when stderrFd is readable:  scpwrap_stream_read(&s, 1, stderrFd);
+ *   ... until scpwrap_stream_closed(&s), then close the fds and waitpid()
+ *
+ * Templates are compiled once with scpwrap_template_compile(), and rendered into a
+ * scpwrap_outbuf with the fields of an event.
+ *
+ * Like scpwrap, the library exits the process if memory can't be allocated for a
+ * buffer that needs to grow.
+ *
+ * Link with -lscpwrap -lutil -lm.
+ */
+
+#ifndef LIBSCPWRAP_H
+#define LIBSCPWRAP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// lines longer than this are split
+#define SCPWRAP_LINE_MAXSIZE (1024*1024)
+
+// size of the blocks an arena takes from the heap; larger allocations get a block of their own
+#define SCPWRAP_ARENA_BLOCKSIZE 16384
+
+// escaping applied to fields when a template is rendered
+#define SCPWRAP_ESCAPE_NONE 0
+#define SCPWRAP_ESCAPE_JS 1
+#define SCPWRAP_ESCAPE_JSON 2
+
+// the fields of a progress event, in the same order as the %f, %p, %t, %s and %e placeholders
+#define SCPWRAP_PROGRESS_FIELDS 5
+#define SCPWRAP_FIELD_FILENAME 0
+#define SCPWRAP_FIELD_PERCENT 1
+#define SCPWRAP_FIELD_BYTES 2
+#define SCPWRAP_FIELD_SPEED 3
+#define SCPWRAP_FIELD_ETA 4
+
+// values for scpwrap_event.type
+#define SCPWRAP_EVENT_PROGRESS 0     // a progress line; progress is set
+#define SCPWRAP_EVENT_TEXT 1         // any other line; text and len are set
+#define SCPWRAP_EVENT_END_OF_FILE 2  // a blank line in the progress meter output, which ends the current file
+
+/** a string value to be substituted into a template placeholder;
+   doesn't need to be NUL-terminated */
+struct scpwrap_field {
+    const char *str;
+    size_t len;
+};
+
+/** A region of memory that objects with the same lifetime are allocated from, and 
+   which is freed all at once.
+
+   Small allocations are carved out of blocks of SCPWRAP_ARENA_BLOCKSIZE bytes, with 
+   no per-allocation overhead; larger ones (e.g. capture buffers that have grown to fit
+   a long line) get a block of their own, which is resized with realloc() when the 
+   allocation grows. Nothing is freed individually.
+ */
+struct scpwrap_arena {
+    struct scpwrap_arena_block *blocks; // blocks taken from the heap, the one being carved up first
+    size_t used;                    // bytes used in the first block
+    size_t heapBytes;               // bytes taken from the heap, including block headers
+    unsigned long heapCalls;        // number of malloc() and realloc() calls made
+};
+
+/** Output buffer that templates are rendered into */
+struct scpwrap_outbuf {
+    char *buf;        // rendered output
+    size_t len;       // number of bytes in buf
+    size_t size;      // allocated size of buf
+    struct scpwrap_arena *arena; // arena that buf is allocated from, or NULL for the heap
+};
+
+/** a compiled template.
+
+   The template text (with any escapes already resolved) is split into spans
+   at compile time; each span is either a run of literal text, or a reference
+   to the field that replaces a placeholder.
+ */
+struct scpwrap_template {
+    const char *name;     // option name used to supply the template, for error messages
+    struct scpwrap_arena *arena; // arena that text and spans are allocated from, or NULL for the heap
+    char *text;           // template text with escapes resolved
+    int escapeMode;       // SCPWRAP_ESCAPE_* mode applied to fields
+    int nspans;           // number of spans in the template
+    unsigned int fieldMask; // bit n is set if the template contains a reference to field n
+    struct scpwrap_span {
+        int field;        // index of the field for this span, or -1 for literal text
+        size_t off;       // offset of literal text in text
+        size_t len;       // length of literal text
+    } *spans;
+};
+
+/** Splits the data read from a file descriptor into lines. Only used through
+   scpwrap_stream; the fields are private.
+
+   Data is read in large chunks into buf; each line is returned in place, including
+   its '\r' or '\n' terminator. Any partial line left over is moved back to the start
+   of buf before the next read, and buf grows if a single line doesn't fit into it
+   (up to SCPWRAP_LINE_MAXSIZE bytes).
+ */
+struct scpwrap_framer {
+    char *buf;        // capture buffer
+    size_t size;      // allocated size of buf
+    size_t start;     // offset of the first byte in buf not yet returned in a line
+    size_t end;       // offset after the last byte read into buf
+    size_t scan;      // offset in buf from which to continue looking for line terminators
+    int held;         // byte overwritten by the NUL after the last line returned, or -1
+    int eof;          // set to 1 when the output has been closed
+};
+
+/** a progress line recognised by a parser. The fields point into the line, which
+   the parser NUL-terminates them in, or to the parser state or string constants */
+struct scpwrap_progress {
+    struct scpwrap_field fv[SCPWRAP_PROGRESS_FIELDS]; // filename, percent, transfer size, speed and ETA text
+    double bytes;                   // bytes copied so far in the file
+    double rate;                    // speed of the file in bytes per second
+};
+
+/** state kept by a parser between the lines of a process's output */
+struct scpwrap_parse_state {
+    char *name;                     // name of the file being copied, if not in the progress lines
+    size_t nameLen, nameSize;
+    struct scpwrap_arena *arena;    // arena that name is allocated from, or NULL for the heap
+};
+
+/** a progress meter parser */
+struct scpwrap_parser {
+    const char *name;               // "scp", "rsync", "curl" or "pv"
+    int isStderr;                   // 1 if the progress meter is written to stderr, 0 for stdout
+    // parse a line (including its terminator), which can be modified if it's a progress line.
+    // returns 1 if it's a progress line, 0 if it should be emitted as text, or -1 if it should be ignored
+    int (*parse)(struct scpwrap_parse_state *ps, char *line, size_t len, struct scpwrap_progress *p);
+};
+
+/** an event for a line of a process's output */
+struct scpwrap_event {
+    int type;                       // SCPWRAP_EVENT_*
+    int isStderr;                   // 1 if the line was read from stderr, 0 for stdout
+    int endsFile;                   // 1 if the line ends the current file (i.e. it's in the progress meter output)
+    const char *text;               // for SCPWRAP_EVENT_TEXT, the NUL-terminated line, including its terminator
+    size_t len;                     // length of text
+    const struct scpwrap_progress *progress; // for SCPWRAP_EVENT_PROGRESS, the parsed progress line
+};
+
+/** called with each event; the event is only valid until the callback returns */
+typedef void (*scpwrap_callback)(void *ctx, const struct scpwrap_event *ev);
+
+/** The output of a process (or of each process in turn), and the state used to parse it */
+struct scpwrap_stream {
+    struct scpwrap_arena *arena;    // arena that the buffers are allocated from, or NULL for the heap
+    const struct scpwrap_parser *parser;
+    scpwrap_callback callback;
+    void *ctx;                      // passed to callback
+    struct scpwrap_framer framers[2]; // stdout and stderr capture buffers
+    struct scpwrap_parse_state ps;  // progress meter parser state
+    unsigned long long lines;       // number of lines framed, for all processes
+};
+
+/** initialise an arena. No memory is taken from the heap until something is allocated from it */
+void scpwrap_arena_init(struct scpwrap_arena *a);
+
+/** allocate n bytes from an arena, aligned for any type.
+   returns NULL if the memory could not be allocated */
+void *scpwrap_arena_alloc(struct scpwrap_arena *a, size_t n);
+
+/** resize an allocation from an arena, which is extended in place if possible; 
+   otherwise its contents are copied to a new allocation. p may be NULL if oldSize is 0.
+   returns the (possibly moved) allocation, or NULL if the memory could not be allocated 
+   (in which case p is still valid) */
+void *scpwrap_arena_grow(struct scpwrap_arena *a, void *p, size_t oldSize, size_t newSize);
+
+/** copy n bytes of a string into an arena, and NUL-terminate it.
+   returns NULL if the memory could not be allocated */
+char *scpwrap_arena_strndup(struct scpwrap_arena *a, const char *str, size_t n);
+
+/** free everything allocated from an arena, which can then be used again */
+void scpwrap_arena_free(struct scpwrap_arena *a);
+
+/** initialise an output buffer, allocated from arena (or the heap, if arena is NULL).
+   returns 0 on success, or -1 if the buffer could not be allocated */
+int scpwrap_outbuf_init(struct scpwrap_outbuf *ob, struct scpwrap_arena *arena, size_t size);
+
+/** ensure there's room for at least n more bytes in the output buffer */
+void scpwrap_outbuf_reserve(struct scpwrap_outbuf *ob, size_t n);
+
+/** append n bytes to the output buffer */
+void scpwrap_outbuf_append(struct scpwrap_outbuf *ob, const char *str, size_t n);
+
+/** free an output buffer (if it was allocated from the heap) */
+void scpwrap_outbuf_free(struct scpwrap_outbuf *ob);
+
+/** convert text to a javascript or JSON string escape (mode is SCPWRAP_ESCAPE_JS or
+   SCPWRAP_ESCAPE_JSON), appending the result to the output buffer */
+void scpwrap_escape_append(struct scpwrap_outbuf *ob, int mode, const char *text, size_t n);
+
+/** compile a template, allocated from arena (or the heap, if arena is NULL), where the n'th
+   character of placeholders is the placeholder for the n'th field passed to 
+   scpwrap_template_render(). Placeholders in reserved that aren't in placeholders are 
+   reported as errors. name is used in error messages.
+   returns 0 on success, or -1 if the template is invalid (an error message is sent to stderr) */
+int scpwrap_template_compile(struct scpwrap_template *t, struct scpwrap_arena *arena, const char *name, 
+    const char *src, const char *placeholders, const char *reserved, int escapeMode);
+
+/** render a compiled template into the output buffer */
+void scpwrap_template_render(struct scpwrap_outbuf *ob, const struct scpwrap_template *t,
+    const struct scpwrap_field *fields);
+
+/** free a compiled template (if it was allocated from the heap) */
+void scpwrap_template_free(struct scpwrap_template *t);
+
+/** convert a size or speed from a progress line (e.g. "2112KB" or "2.1MB/s") into a number of bytes */
+double scpwrap_parse_size(const char *str);
+
+/** convert an ETA from a progress line (e.g. "05:23" or "--:--") into seconds, or -1 if it's not known */
+double scpwrap_parse_eta(const char *str);
+
+/** return the parser with the given name ("scp", "rsync", "curl" or "pv"), or NULL if there isn't one */
+const struct scpwrap_parser *scpwrap_parser_find(const char *name);
+
+/** initialise a stream, with buffers allocated from arena (or the heap, if arena is NULL);
+   events are passed to callback with ctx.
+   returns 0 on success, or -1 if its buffers could not be allocated */
+int scpwrap_stream_init(struct scpwrap_stream *s, struct scpwrap_arena *arena,
+    const struct scpwrap_parser *parser, scpwrap_callback callback, void *ctx);
+
+/** reset a stream for the output of a new process, run with the arguments args
+   (which may be NULL); parsers whose progress meter doesn't include a filename use
+   the last part of its last argument that isn't an option */
+void scpwrap_stream_start(struct scpwrap_stream *s, char **args);
+
+/** return a pointer to where output from stdout (if isStderr is 0) or stderr (if isStderr is 1)
+   can be placed, and store the number of bytes there's room for in *avail; this is always
+   at least 1. Call scpwrap_stream_push() with the number of bytes placed there */
+char *scpwrap_stream_space(struct scpwrap_stream *s, int isStderr, size_t *avail);
+
+/** process n bytes placed at the pointer returned by scpwrap_stream_space(), calling back
+   with an event for each complete line */
+void scpwrap_stream_push(struct scpwrap_stream *s, int isStderr, size_t n);
+
+/** copy len bytes of output into the stream, calling back with an event for each complete line */
+void scpwrap_stream_feed(struct scpwrap_stream *s, int isStderr, const char *data, size_t len);
+
+/** read once from fd (which should be non-blocking), and process the output. If fd has
+   been closed (or returned an error), the stream is closed with scpwrap_stream_close().
+   returns the number of bytes read, 0 if fd has been closed, or -1 if no data was available */
+ssize_t scpwrap_stream_read(struct scpwrap_stream *s, int isStderr, int fd);
+
+/** mark stdout or stderr as closed, calling back with an event for any unterminated last line */
+void scpwrap_stream_close(struct scpwrap_stream *s, int isStderr);
+
+/** returns 1 if both stdout and stderr have been closed */
+int scpwrap_stream_closed(const struct scpwrap_stream *s);
+
+/** free a stream's buffers (if they were allocated from the heap) */
+void scpwrap_stream_free(struct scpwrap_stream *s);
+
+/** start a process with stdout connected to a pseudoterminal (so that scp displays its
+   progress meter) and stderr connected to a pipe, and store the non-blocking file
+   descriptors used to read them in *stdoutFd and *stderrFd.
+   returns the pid of the process, or -1 if it couldn't be started (an error message is
+   sent to stderr) */
+pid_t scpwrap_spawn(char **args, int *stdoutFd, int *stderrFd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
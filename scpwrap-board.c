@@ -0,0 +1,91 @@
+/* scpwrap-board.c
+ *
+ * $Id$
+ *
+ * Displays the progress board published by "scpwrap --board file", without
+ * interrupting or slowing down scpwrap. The board format, and the functions used
+ * to read it, are in scpwrap-board.h, which can be used by other programs to
+ * monitor scpwrap the same way.
+ *
+ * usage: scpwrap-board [-w seconds] file
+ *
+ *   -w seconds  display the board every n seconds until scpwrap finishes
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scpwrap-board.h"
+
+static const char *STATE_NAMES[] = { "idle", "running", "exited" };
+
+/** display a snapshot of the board */
+static void board_print(struct board_header *h) {
+    struct board_slot *slot;
+    uint32_t i;
+    printf("pid %d: %s", h->pid, h->finished ? "finished" : "running");
+    if (h->finished) { printf(" (exit code %d)", h->exitCode); }
+    printf(", %.0f of %.0f bytes, %.0f bytes/s, ETA %.0fs, %.0f%%\n",
+        h->bytes, h->total, h->rate, h->eta, h->percent);
+    printf("%-6s %-7s %4s %6s %4s %14s %12s %6s %s\n",
+        "worker", "state", "exit", "file", "%", "bytes", "bytes/s", "ETA", "filename");
+    for (i=0; i<h->nslots; i++) {
+        slot = board_slot(h, i);
+        printf("%-6u %-7s %4d %6d %4d %14.0f %12.0f %6.0f %s\n", i,
+            slot->state >= 0 && slot->state <= BOARD_EXITED ? STATE_NAMES[slot->state] : "?",
+            slot->exitCode, slot->fileId, slot->percent, slot->bytes, slot->rate, slot->eta, slot->name);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    double interval = 0;
+    struct board_header *board, *snapshot;
+    struct timespec ts;
+    struct stat sb;
+    int c, fd;
+
+    while ((c = getopt(argc, argv, "w:")) != -1) {
+        switch (c) {
+            case 'w': interval = atof(optarg); break;
+            default:
+                fprintf(stderr, "usage: scpwrap-board [-w seconds] file\n");
+                exit(1);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: scpwrap-board [-w seconds] file\n");
+        exit(1);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd == -1 || fstat(fd, &sb) == -1) { perror(argv[optind]); exit(1); }
+    board = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (board == MAP_FAILED) { perror("mmap"); exit(1); }
+    close(fd);
+    snapshot = malloc(sb.st_size);
+    if (snapshot == NULL) { perror("malloc"); exit(1); }
+
+    while (1) {
+        if (sb.st_size < (off_t) sizeof(struct board_header) || board_snapshot(board, sb.st_size, snapshot) == -1) {
+            if (sb.st_size >= (off_t) sizeof(struct board_header) && (board->seq & 1)) {
+                fprintf(stderr, "%s was left part way through an update by scpwrap (pid %d)\n", argv[optind], (int) board->pid);
+            } else {
+                fprintf(stderr, "%s is not an scpwrap progress board\n", argv[optind]);
+            }
+            exit(1);
+        }
+        board_print(snapshot);
+        if (interval <= 0 || snapshot->finished) { break; }
+        ts.tv_sec = (time_t) interval;
+        ts.tv_nsec = (long) ((interval - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* scpwrap-board.h
+ *
+ * $Id$
+ *
+ * Format of the progress board file written by "scpwrap --board file", and functions
+ * for reading it from other processes.
+ *
+ * The file is memory-mapped by scpwrap, which updates it in place as progress lines
+ * are parsed. It contains a board_header, followed by a board_slot for each worker
+ * (i.e. each concurrent scp process). Readers map the file read-only and take a
+ * snapshot using board_snapshot(), which uses the seqlock in the header to get a
+ * consistent copy without any system calls or locks; any number of readers can do
+ * this at once, and readers never block the writer.
+ *
+ * The file remains after scpwrap exits, with the header's finished field set to 1.
+ */
+
+#ifndef SCPWRAP_BOARD_H
+#define SCPWRAP_BOARD_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BOARD_MAGIC "scpwbrd"      // 8 bytes, including the NUL
+#define BOARD_VERSION 1
+#define BOARD_NAME_SIZE 256        // filenames longer than this are truncated
+
+// number of times board_snapshot() checks for an update to finish before giving up, in case
+// scpwrap crashed during it (about a second)
+#define BOARD_SNAPSHOT_SPINS (1UL << 30)
+
+// values for board_slot.state
+#define BOARD_IDLE 0               // the worker hasn't started an scp process yet
+#define BOARD_RUNNING 1            // the worker's scp process is running
+#define BOARD_EXITED 2             // the worker's last scp process has exited; exitCode is set
+
+/** state of the whole job */
+struct board_header {
+    char magic[8];                 // BOARD_MAGIC
+    uint32_t version;              // BOARD_VERSION
+    uint32_t nslots;               // number of board_slots after the header
+    uint32_t seq;                  // seqlock sequence number; odd while the board is being updated
+    int32_t pid;                   // pid of the scpwrap process
+    int32_t finished;              // set to 1 when scpwrap has finished
+    int32_t exitCode;              // exit code of the first scp process that failed, or -(signal number)
+    double bytes;                  // bytes copied so far, in all files (as per %B)
+    double total;                  // total bytes to copy, or -1 if unknown (%T)
+    double rate;                   // smoothed throughput in bytes per second (%R)
+    double eta;                    // ETA for all files in seconds, or -1 if unknown (%E)
+    double percent;                // progress for all files (0-100), or -1 if unknown (%P)
+    uint64_t updates;              // number of times the board has been updated
+};
+
+/** state of a worker, and the file it's copying */
+struct board_slot {
+    int32_t state;                 // BOARD_IDLE, BOARD_RUNNING or BOARD_EXITED
+    int32_t exitCode;              // exit code of the worker's last scp process, or -(signal number)
+    int32_t fileId;                // number of the file being copied (as per %i), or -1
+    int32_t percent;               // progress of the file (0-100)
+    double bytes;                  // bytes copied so far in the file
+    double rate;                   // speed reported by scp, in bytes per second
+    double eta;                    // ETA reported by scp, in seconds, or -1 if unknown
+    char name[BOARD_NAME_SIZE];    // NUL-terminated filename
+};
+
+/** return the number of bytes in a board with nslots slots */
+static inline size_t board_size(uint32_t nslots) {
+    return sizeof(struct board_header) + nslots * sizeof(struct board_slot);
+}
+
+/** return a pointer to the n'th slot in a board */
+static inline struct board_slot *board_slot(struct board_header *h, uint32_t n) {
+    return (struct board_slot *) (h + 1) + n;
+}
+
+/** start updating a board; readers will retry any snapshot taken while it's being updated */
+static inline void board_begin(struct board_header *h) {
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/** finish updating a board */
+static inline void board_end(struct board_header *h) {
+    h->updates++;
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/** copy a consistent snapshot of the board (of size bytes, i.e. board_size(h->nslots))
+   into dest. returns 0 on success, or -1 if the board isn't a version BOARD_VERSION
+   board of that size, or an update didn't finish within BOARD_SNAPSHOT_SPINS checks
+   (h->seq is left odd if scpwrap crashed during an update) */
+static inline int board_snapshot(const struct board_header *h, size_t size, struct board_header *dest) {
+    uint32_t seq1, seq2;
+    unsigned long spins = 0;
+    if (memcmp(h->magic, BOARD_MAGIC, sizeof(h->magic)) != 0 || h->version != BOARD_VERSION ||
+        size < board_size(h->nslots)) {
+        return -1;
+    }
+    do {
+        while ((seq1 = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE)) & 1) { 
+            if (++spins == BOARD_SNAPSHOT_SPINS) { return -1; }
+        }
+        memcpy(dest, h, board_size(h->nslots));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq2 = __atomic_load_n(&h->seq, __ATOMIC_RELAXED);
+    } while (seq1 != seq2);
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,139 @@
+/* scpwrap-decode.c
+ *
+ * $Id$
+ *
+ * Decodes the output of "scpwrap --binary", which is read from stdin (or a file). Text
+ * events are written to stdout as they are, and each progress event is written as a
+ * complete JSON progress event, in the same format as the default --json progressTemplate
+ * (with fields escaped by libscpwrap, as they are by --json):
+ *
+ *   {"event":"progress","worker":0,"id":0,"file":"a.txt","percent":50,"size":"512KB","speed":"1.0MB/s","eta":"00:01"}
+ *
+ * The format is described in scpwrap-delta.h.
+ *
+ * usage: scpwrap-decode [file]
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libscpwrap.h"
+#include "scpwrap-delta.h"
+
+#define READ_BUFSIZE 65536
+
+// the mask of the first progress event for each file
+#define ALL_FIELDS (DELTA_WORKER | ((1 << DELTA_FIELDS) - 1))
+
+/** the fields of a file, from the progress events received for it so far */
+struct file {
+    uint64_t worker;
+    uint64_t percent;
+    char *str[DELTA_FIELDS];        // text of each field, or NULL
+    size_t len[DELTA_FIELDS];
+};
+
+static struct file *FILES = NULL;
+static size_t NFILES = 0;
+
+// a field escaped as a JSON string
+static struct scpwrap_outbuf ESCAPED;
+
+/** write a field as a JSON string, escaped the same way as "scpwrap --json" escapes it */
+static void json_string(const char *str, size_t len, FILE *out) {
+    ESCAPED.len = 0;
+    scpwrap_escape_append(&ESCAPED, SCPWRAP_ESCAPE_JSON, str, len);
+    putc('"', out);
+    fwrite(ESCAPED.buf, 1, ESCAPED.len, out);
+    putc('"', out);
+}
+
+/** update a file's fields from a progress event, and write the complete event.
+   returns 0 on success, or -1 if the event is for an unknown file and doesn't contain every field */
+static int decode_progress(struct delta_progress *dp, FILE *out) {
+    struct file *f;
+    int i;
+    if (dp->fileId >= NFILES) {
+        size_t n = dp->fileId + 1 > NFILES * 2 ? dp->fileId + 1 : NFILES * 2;
+        FILES = realloc(FILES, n * sizeof(struct file));
+        if (FILES == NULL) { perror("realloc"); exit(1); }
+        memset(FILES + NFILES, 0, (n - NFILES) * sizeof(struct file));
+        NFILES = n;
+    }
+    f = &FILES[dp->fileId];
+    // the filename is only NULL if there hasn't been an event for the file yet
+    if (f->str[0] == NULL && (dp->mask & ALL_FIELDS) != ALL_FIELDS) { return -1; }
+    if (dp->mask & DELTA_WORKER) { f->worker = dp->worker; }
+    if (dp->mask & DELTA_PERCENT) { f->percent = dp->percent; }
+    for (i=0; i<DELTA_FIELDS; i++) {
+        if (!(dp->mask & (1 << i)) || (1 << i) == DELTA_PERCENT) { continue; }
+        // allocated with at least one byte, as the filename is only NULL until the first event
+        f->str[i] = realloc(f->str[i], dp->len[i] + 1);
+        if (f->str[i] == NULL) { perror("realloc"); exit(1); }
+        memcpy(f->str[i], dp->str[i], dp->len[i]);
+        f->len[i] = dp->len[i];
+    }
+    fprintf(out, "{\"event\":\"progress\",\"worker\":%llu,\"id\":%llu,\"file\":",
+        (unsigned long long) f->worker, (unsigned long long) dp->fileId);
+    json_string(f->str[0], f->len[0], out);
+    fprintf(out, ",\"percent\":%llu,\"size\":", (unsigned long long) f->percent);
+    json_string(f->str[2], f->len[2], out);
+    fputs(",\"speed\":", out);
+    json_string(f->str[3], f->len[3], out);
+    fputs(",\"eta\":", out);
+    json_string(f->str[4], f->len[4], out);
+    fputs("}\n", out);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned char *buf;
+    const unsigned char *payload;
+    size_t size = READ_BUFSIZE, len = 0, off, payloadLen;
+    unsigned long pos = 0;            // offset in the input of buf[0]
+    struct delta_progress dp;
+    ssize_t n;
+    long frameLen;
+    int fd = STDIN_FILENO, type;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-' && argv[1][1] != 0)) {
+        fprintf(stderr, "usage: scpwrap-decode [file]\n");
+        exit(1);
+    }
+    if (argc == 2 && strcmp(argv[1], "-") != 0 && freopen(argv[1], "rb", stdin) == NULL) {
+        perror(argv[1]);
+        exit(1);
+    }
+    buf = malloc(size);
+    if (buf == NULL || scpwrap_outbuf_init(&ESCAPED, NULL, 256) == -1) { perror("malloc"); exit(1); }
+
+    while ((n = read(fd, buf + len, size - len)) > 0) {
+        len += n;
+        off = 0;
+        while ((frameLen = delta_next(buf + off, len - off, &type, &payload, &payloadLen)) > 0) {
+            if (type == DELTA_TEXT) {
+                fwrite(payload, 1, payloadLen, stdout);
+            } else if (type != DELTA_PROGRESS || delta_progress(payload, payloadLen, &dp) == -1 ||
+                decode_progress(&dp, stdout) == -1) {
+                fprintf(stderr, "invalid frame at offset %lu\n", (unsigned long) (pos + off));
+                exit(1);
+            }
+            off += frameLen;
+        }
+        if (frameLen == -1) { fprintf(stderr, "invalid frame at offset %lu\n", (unsigned long) (pos + off)); exit(1); }
+        fflush(stdout);
+        // keep any partial frame, and make room for the rest of it
+        memmove(buf, buf + off, len - off);
+        len -= off;
+        pos += off;
+        if (len == size) {
+            size *= 2;
+            buf = realloc(buf, size);
+            if (buf == NULL) { perror("realloc"); exit(1); }
+        }
+    }
+    if (n == -1) { perror("read"); exit(1); }
+    if (len > 0) { fprintf(stderr, "truncated frame at end of input\n"); exit(1); }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* scpwrap-delta.h
+ *
+ * $Id$
+ *
+ * Format of the output written by "scpwrap --binary", and functions for decoding it
+ * in other programs (see scpwrap-decode.c).
+ *
+ * The output is a sequence of frames. Each frame is an unsigned LEB128 varint
+ * containing the length of the rest of the frame, followed by a type byte and the
+ * frame's payload:
+ *
+ *   DELTA_TEXT      an event rendered by a template (start, stdout, stderr, retry or end)
+ *   DELTA_PROGRESS  a progress event, containing:
+ *                     file id    varint; the file number (as per %i)
+ *                     mask       byte; the DELTA_* bits of the fields that follow
+ *                     worker     varint; the worker number (as per %w), if DELTA_WORKER is set
+ *                     fields     for each of the DELTA_FILENAME .. DELTA_ETA bits that are set,
+ *                                in that order: the percent as a varint, or for the other
+ *                                fields, a varint length followed by that many bytes of text
+ *
+ * A progress event only contains the fields that have changed since the last progress
+ * event for the same file id, so the decoder must keep the fields of each file; the
+ * first event for each file id contains every field.
+ */
+
+#ifndef SCPWRAP_DELTA_H
+#define SCPWRAP_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// frame types
+#define DELTA_TEXT 0
+#define DELTA_PROGRESS 1
+
+// number of fields in a progress event, excluding the worker number
+#define DELTA_FIELDS 5
+
+// bits in the mask of a progress event. Bit n is set if field n is present, where the
+// fields are in the same order as the %f, %p, %t, %s and %e placeholders
+#define DELTA_FILENAME 0x01
+#define DELTA_PERCENT 0x02
+#define DELTA_SIZE 0x04
+#define DELTA_SPEED 0x08
+#define DELTA_ETA 0x10
+#define DELTA_WORKER 0x20
+
+/** the contents of a progress frame */
+struct delta_progress {
+    uint64_t fileId;
+    int mask;                      // DELTA_* bits of the fields present
+    uint64_t worker;               // if DELTA_WORKER is set
+    uint64_t percent;              // if DELTA_PERCENT is set
+    const char *str[DELTA_FIELDS]; // text of each field present except the percent (not NUL-terminated)
+    size_t len[DELTA_FIELDS];
+};
+
+/** read an unsigned LEB128 varint from *p, which is advanced past it.
+   returns 0 on success, or -1 if it extends past end */
+static inline int delta_varint(const unsigned char **p, const unsigned char *end, uint64_t *n) {
+    int shift = 0;
+    *n = 0;
+    while (*p < end && shift < 64) {
+        *n |= (uint64_t) (**p & 0x7f) << shift;
+        if (!(*(*p)++ & 0x80)) { return 0; }
+        shift += 7;
+    }
+    return -1;
+}
+
+/** find the first frame in the len bytes at buf. Sets *type, and *payload and *payloadLen
+   to the payload after the type byte. returns the number of bytes in the frame, 0 if
+   buf doesn't contain a complete frame yet, or -1 if the frame is invalid */
+static inline long delta_next(const unsigned char *buf, size_t len, int *type,
+    const unsigned char **payload, size_t *payloadLen) {
+    const unsigned char *p = buf, *end = buf + len;
+    uint64_t n;
+    if (delta_varint(&p, end, &n) == -1) { return len < 10 ? 0 : -1; }
+    if (n == 0) { return -1; }
+    if (n > (uint64_t) (end - p)) { return 0; }
+    *type = p[0];
+    *payload = p + 1;
+    *payloadLen = n - 1;
+    return (long) (p - buf + n);
+}
+
+/** parse the payload of a DELTA_PROGRESS frame. returns 0 on success, or -1 if it's invalid */
+static inline int delta_progress(const unsigned char *payload, size_t len, struct delta_progress *dp) {
+    const unsigned char *p = payload, *end = payload + len;
+    uint64_t n;
+    int i;
+    if (delta_varint(&p, end, &dp->fileId) == -1 || p == end) { return -1; }
+    dp->mask = *p++;
+    if ((dp->mask & DELTA_WORKER) && delta_varint(&p, end, &dp->worker) == -1) { return -1; }
+    for (i=0; i<DELTA_FIELDS; i++) {
+        if (!(dp->mask & (1 << i))) { continue; }
+        if (delta_varint(&p, end, &n) == -1) { return -1; }
+        if (1 << i == DELTA_PERCENT) {
+            dp->percent = n;
+        } else {
+            if (n > (uint64_t) (end - p)) { return -1; }
+            dp->str[i] = (const char *) p;
+            dp->len[i] = n;
+            p += n;
+        }
+    }
+    return p == end ? 0 : -1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,456 +1,2704 @@
-/* scpwrap.c
- * 
- * $Id$
- *
- * Wrapper for scp which translates progress text (e.g. "50%") 
- * into javascript which generates/updates a progress bar.
- *
- * Call this thing from a bash script that dumps it's output directly into an iframe 
- * which is surrounded by <script> elements.
- *
- * COMPILING
- * 
- * Remember to include the util library when compiling !
- * i.e. gcc -lutil scpwrap.c -oscpwrap
- *
- * as of 2013, you could try doing this instead, for reasons that I don't particularly understand:
- *      gcc -Wl,--no-as-needed -lutil scpwrap.c -oscpwrap
- * 
- * Modified from http://cwshep.blogspot.com/2009/06/showing-scp-progress-using-zenity.html
- *
- * Tempted to patch scp.c directly. Although scp.c will still display the progress bar if
- * stderr is redirected to a non-tty 
- * ( http://www.openbsd.org/cgi-bin/cvsweb/src/usr.bin/ssh/scp.c?rev=1.178;content-type=text%2Fx-cvsweb-markup )
- *
- * see http://www.linuxquestions.org/questions/programming-9/problem-with-child-process-658750/#post3229496
-       http://www.openbsd.org/cgi-bin/cvsweb/src/usr.bin/ssh/scp.c?rev=1.178;content-type=text%2Fx-cvsweb-markup
-       http://stackoverflow.com/questions/2605130/redirecting-exec-output-to-a-buffer-or-file
-       http://stackoverflow.com/questions/903864/how-to-exit-a-child-process-and-return-its-status-from-execvp
- */
-
-#include <unistd.h>
-#include <sys/types.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdarg.h>
-#include <sys/select.h>
-#include <getopt.h>
- 
-/* let's say that the things we're going to replace in here are:
- * %f - filename
- * %p - progress (0-100) and "%" character
- * %t - transfer size ("2112KB")
- * %s - speed ("2.1MB/s" or however progressmeter.c does things)
- * %e - ETA ("--:--" or "05:23"), hh:mm:ss, or however progressmeter.c does things)
- */
-
-// if we get more than this number of bytes on stdout/stderr without a newline,
-// then they will be emitted in >1 stdout/stderr template 
-#define STDERR_BUFSIZE 1024
-#define STDOUT_BUFSIZE 1024
-
-// enabled by --js option; stdout/stderr will be javascript-String escaped
-static int ESCAPE_JS = 0;
-
-static char* TXT_STDOUT_TEMPLATE = "";
-static char* TXT_STDERR_TEMPLATE = "";
-static char* TXT_START_TEMPLATE = "";
-static char* TXT_PROGRESS_TEMPLATE = "%p\n";
-static char* TXT_END_TEMPLATE = "";
-
-static char* JS_STDOUT_TEMPLATE = "ui.addOutput(\"%s\");\n";
-static char* JS_STDERR_TEMPLATE = "ui.addOutputError(\"%s\");\n";
-static char* JS_START_TEMPLATE = "var sp = ui.startScpProgress();\n";
-static char* JS_PROGRESS_TEMPLATE = "sp.setProgress(\"%f\", %p, \"%t\", \"%s\", \"%e\");\n";
-static char* JS_END_TEMPLATE = "ui.stopScpProgress(%c);\n";
-
-/** convert ASCII to javascript escape.
-
-    see http://rishida.net/tools/conversion
- */ 
-void printjs (char *str) {
-    int i=0;
-    for (i=0; str[i]!=0; i++) {
-        switch (str[i]) {
-            case 0: printf("\\0"); break;
-            case 8: printf("\\b"); break;
-            case 9: printf("\\t"); break;
-            case 10: printf("\\n"); break;
-            case 13: printf("\\r"); break;
-            case 11: printf("\\v"); break;
-            case 12: printf("\\f"); break;
-            case 34: printf("\\\""); break;
-            case 39: printf("\\\'"); break;
-            case 92: printf("\\\\"); break;
-            default:
-                if (str[i]>0x1f && str[i]<0x7F) { 
-                    printf("%c", str[i]); 
-                } else { 
-                    printf("\\u%04x", (int) str[i]); 
-                }
-        }       
-    }
-}
-
-/** Take a format string ("template") containing 0 or more tokens in the form 
-   "{n}", and replace each token with the n'th optional parameter to this function. 
-   The string after token replacement is sent to stdout. 
-   
-   The nparam must be set to the number of optional parameters supplied.
-   All optional parameters must be of type char*.
-   
-   e.g. 
-     printfmt(3, "first: {0}, second: {1}, third: {2}", "a", "b", "c");
-   produces the output
-     "first: a, second: b, third: c"
-
-   C-like escapes ("\n", "\t" etc) in the format string will be converted into their appropriate character     
-   if JS_ESCAPE is true, then values in the optional parameters will be Javascript-escaped
-     (i.e. the character '\n' will be converted to the two-character "\n" escape) 
- */  
-int printfmt (int nparam, const char *format, ...) {
-    va_list ap;
-    int i = 0;
-    int inBrace = 0, inEscape = 0;
-    int paramIdx = 0;
-  
-    char *params[nparam];
-    va_start(ap, format);
-    for (i=0; i<nparam; i++) { 
-        params[i] = va_arg(ap, char *);
-    }  
-    va_end(ap);
-  
-    for (i=0; format[i]!=0; i++) {
-        if (inEscape) {
-            inEscape = 0;
-            switch (format[i]) {
-                case 'n': printf("\n"); break;
-                case 'r': printf("\r"); break;
-                case 't': printf("\t"); break;
-                case '{': printf("{"); break;
-                case '\\': printf("\\"); break;
-                default: /* unknown escape, just print character */ printf("%c", format[i]);
-            }
-        } else if (inBrace) {
-            switch (format[i]) {
-                case '0': case '1': case '2': case '3': case '4': 
-                case '5': case '6': case '7': case '8': case '9':
-                    paramIdx = paramIdx*10 + (format[i]-'0');
-                    break;
-                case '}': 
-                    inBrace = 0; 
-                    if (ESCAPE_JS) { 
-                        printjs(params[paramIdx]); 
-                    } else { 
-                        printf("%s", params[paramIdx]); 
-                    }
-                    break;
-                default:
-                    // weird thing in brace
-                    return -1;
-            }      
-        } else {      
-            switch (format[i]) {
-                case '{':  paramIdx = 0; inBrace = 1; break;
-                case '\\': inEscape = 1; break;
-                default: printf("%c", format[i]); 
-            }
-        }
-    }
-}
-
-/** send usage information to stdout */ 
-void usage() {
-    printf("usage: scpwrap [options] -- scp-options \n"
-      "Where options are:\n" 
-      "  --js                   use javascript default templates, and javascript-escape output strings\n"
-      "  --stdoutTemplate txt   template to use for unrecognised stdout text\n"
-      "  --stderrTemplate txt   template to use for unrecognised stderr text\n"
-      "  --startTemplate txt    text to display before the first progressTemplate appears\n"
-      "  --progressTemplate txt template to use for copy progress output\n"
-      "  --endTemplate txt      template to use after copy completes\n"
-      "The following placeholders can be used in progress templates:\n"
-      "  %%f  filename\n"
-      "  %%p  progress amount (0-100)\n"
-      "  %%t  transfer size (e.g. \"2112KB\")\n"
-      "  %%s  speed (e.g. \"2.1MB/s\")\n"
-      "  %%e  ETA (e.g. \"--:--\" or \"05:23\")\n"
-      "The following placeholder can be used in stdout/stderr templates:\n"  
-      "  %%s  text string\n"
-      "The following placeholder can be used in the endTemplate:\n"  
-      "  %%c  exit code\n"
-      "\n"
-      "See the 'scpwrap' and 'scp' man page for more options. Example usage:\n"
-      "  scpwrap --js -- -i identityfile user@host1:file1 user@host2:file2\n"
-      );
-      
-    // This is a program that wraps scp and prints out the numeric progress on separate lines.\n");
-    fflush(stdout);
-}
-
-
-/** replace all instances of a substring in a string with a relacement string.
-   memory for the returned string will be reserved via malloc
-   
-   see http://coding.debuntu.org/c-implementing-str_replace-replace-all-occurrences-substring
- */   
-char *str_replace ( const char *string, const char *substr, const char *replacement ){
-    char *tok = NULL;
-    char *newstr = NULL;
-    char *oldstr = NULL;
-    /* if either substr or replacement is NULL, duplicate string and let caller handle it */
-    if ( substr == NULL || replacement == NULL ) { 
-        return strdup (string); 
-    }
-    newstr = strdup (string);
-    while ( (tok = strstr ( newstr, substr ))) {
-        oldstr = newstr;
-        newstr = malloc ( strlen ( oldstr ) - strlen ( substr ) + strlen ( replacement ) + 1 );
-        /*failed to alloc mem, free old string and return NULL */
-        if ( newstr == NULL ) {
-            free (oldstr);
-            return NULL;
-        }
-        memcpy ( newstr, oldstr, tok - oldstr );
-        memcpy ( newstr + (tok - oldstr), replacement, strlen ( replacement ) );
-        memcpy ( newstr + (tok - oldstr) + strlen( replacement ), tok + strlen ( substr ), strlen ( oldstr ) - strlen ( substr ) - ( tok - oldstr ) );
-        memset ( newstr + strlen ( oldstr ) - strlen ( substr ) + strlen ( replacement ) , 0, 1 );
-        free (oldstr);
-    }
-    return newstr;
-}
-
-/** main */
-main(int argc, char **argv) {
-    char *startTemplate = TXT_START_TEMPLATE;
-    char *stdoutTemplate = TXT_STDOUT_TEMPLATE;
-    char *stderrTemplate = TXT_STDERR_TEMPLATE;
-    char *progressTemplate = TXT_PROGRESS_TEMPLATE;
-    char *endTemplate = TXT_END_TEMPLATE;
-
-    int shownStartTemplate = 0;       // set to 1 when startTemplate is printed
-    
-    char stderrBuf[STDERR_BUFSIZE];   // stderr capture buffer
-    char stdoutBuf[STDOUT_BUFSIZE];   // stdout capture buffer
-    char fieldBuf[STDOUT_BUFSIZE];    // as per stdout, with spaces replaced with \0x0
-        
-    int stderrIdx = 0, stdoutIdx = 0; // indices within stderrBuf/stdoutBuf
-    ssize_t stderrc, stdoutc;         // count of bytes read into stderrBuf/stdoutBuf
-    int doneStderr = 0, doneStdout=0; // set to 1 when stderr/stdout file descriptors have closed
-    
-    int stdoutPtyFd;                  // file descriptor for the master side of the stdout pseudoterminal    
-    int stderrPipeFd[2];              // pipe used to read stderr
-
-    pid_t pid;                        // pid of scp child process
-    int exitStatus = 0;               // scp child process exist status
-
-    // parse options
-    int c;
-    int digit_optind = 0;
-    while (1) {
-        int this_option_optind = optind ? optind : 1;
-        int option_index = 0;
-        static struct option long_options[] = {
-            {"js",               no_argument,       0,  0 },
-            {"startTemplate",    required_argument, 0,  0 },
-            {"stdoutTemplate",   required_argument, 0,  0 },
-            {"stderrTemplate",   required_argument, 0,  0 },
-            {"progressTemplate", required_argument, 0,  0 },
-            {"endTemplate",      required_argument, 0,  0 },
-            {0,         0,                 0,  0 }
-        };
-
-        c = getopt_long(argc, argv, "?", long_options, &option_index);
-        if (c == -1) { break; }
-        switch (c) {
-            case 0:
-                switch (option_index) {
-                    case 0: 
-                        ESCAPE_JS = 1;
-                        startTemplate = JS_START_TEMPLATE;
-                        stdoutTemplate = JS_STDOUT_TEMPLATE;
-                        stderrTemplate = JS_STDERR_TEMPLATE;
-                        progressTemplate = JS_PROGRESS_TEMPLATE;
-                        endTemplate = JS_END_TEMPLATE;
-                        break;
-                    case 1: startTemplate = optarg; break;
-                    case 2: stdoutTemplate = optarg; break;
-                    case 3: stderrTemplate = optarg; break;
-                    case 4: progressTemplate = optarg; break;
-                    case 5: endTemplate = optarg; break;
-                    default:
-                        fprintf(stderr, "getopt returned option_index %d\n", option_index);
-                        exit(1);   
-                }
-                break;
-            case '?':
-                usage(); 
-                exit(1);
-                break;
-            default:
-                fprintf(stderr, "getopt returned character code 0%o '%c'\n", c, c);
-                exit(1);
-        }
-    }
-    if (optind >= argc) {
-       fprintf(stderr, "You must supply options to 'scp' after the '--' command line-argument\n");
-       usage();
-       exit(1);
-    }
-
-    // replace user-specified placeholders (e.g. %s) with positional placeholders (e.g. {0})
-    /* str_replace calls malloc for each result string */
-    stdoutTemplate = str_replace(stdoutTemplate, "%s", "{0}");
-    stderrTemplate = str_replace(stderrTemplate, "%s", "{0}");
-    progressTemplate = str_replace(progressTemplate, "%f", "{0}"); // feel free to tell me that this leaks memory on each str_replace
-    progressTemplate = str_replace(progressTemplate, "%p", "{1}");
-    progressTemplate = str_replace(progressTemplate, "%t", "{2}");
-    progressTemplate = str_replace(progressTemplate, "%s", "{3}");
-    progressTemplate = str_replace(progressTemplate, "%e", "{4}");
-    endTemplate = str_replace(endTemplate, "%c", "{0}");
-    // TODO: check return values for NULL (malloc error)
-   
-    // create pipe for stderr
-    pipe(stderrPipeFd);
-   
-    // get a pseudoterminal
-    pid = forkpty (&stdoutPtyFd, NULL, NULL, NULL);
-    if (pid == 0) {
-        /* CHILD */
-        close(stderrPipeFd[0]);    // close reading end in the child
-        // dup2(stderrPipeFd[1], 1);  // send stdout to the pipe (unused; stdout is the pseudoterminal fd)
-        dup2(stderrPipeFd[1], 2);  // send stderr to the pipe
-        close(stderrPipeFd[1]);    // this descriptor is no longer needed
-
-        // pass arguments "scp" then argv[optind] to argv[argc]
-        // argv[optind-1] should be pointing to the '--' argument so we replace it with "scp"
-        argv[optind-1] = "scp";       
-        execvp("scp", &argv[optind-1]);
-        perror("execvp");
-        _exit (2);
-    } else if (pid == -1) {
-        /* ERROR */
-        perror("forkpty");
-        exit (1);
-    } else {
-        /* PARENT */
-        close(stderrPipeFd[1]);  // close the write end of the pipe in the parent
-        fd_set selectFds;
-        int retval;
-
-        /* Watch stdout (stdoutPtyFd) or stderr (stderrPipeFd[0]) to see when it has input. */
-        FD_ZERO(&selectFds);
-        FD_SET(stdoutPtyFd, &selectFds);
-        FD_SET(stderrPipeFd[0], &selectFds);
-
-        while (!(doneStdout || doneStderr)) {
-            // NB: first param isn't the number of file descriptors, it's the highest file descriptor + 1
-            // FD_SETSIZE may not be terribly efficient, but should work here 
-            retval = select(FD_SETSIZE, &selectFds, NULL, NULL, NULL);
-            if (retval==-1) { 
-                perror("select()"); exit(1);
-            } else {
-                if (FD_ISSET(stderrPipeFd[0], &selectFds) && !doneStderr) {
-                    stderrc = read(stderrPipeFd[0], &stderrBuf[stderrIdx], 1);
-                    //printf ("this shouldnt be more than 1: %d, %c\n", stderrc, stderrBuf[stderrIdx]);
-                    if (stderrc <= 0) {
-                        doneStderr=1;
-                    } else {
-                        stderrIdx += stderrc; 
-                        if (stderrBuf[stderrIdx-1]=='\r' || stderrBuf[stderrIdx-1]=='\n' || stderrIdx==STDERR_BUFSIZE-1) {
-                            stderrBuf[stderrIdx]=0;
-                            printfmt(1, stderrTemplate, stderrBuf);
-                            stderrIdx=0; 
-                        }
-                    }  
-                }
-              
-                if (FD_ISSET(stdoutPtyFd, &selectFds) && !doneStdout) {
-                    stdoutc = read(stdoutPtyFd, &stdoutBuf[stdoutIdx], 1);
-                    // printf ("this shouldnt be more than 1: %d, %c\n", stdoutc, stdoutBuf[stdoutIdx]);
-                    if (stdoutc <= 0) {
-                        doneStdout=1; ;
-                    } else {
-                        stdoutIdx += stdoutc;
-                        if (stdoutBuf[stdoutIdx-1]=='\r' || stdoutBuf[stdoutIdx-1]=='\n' || stdoutIdx==STDOUT_BUFSIZE-1) {
-                            stdoutBuf[stdoutIdx]=0;
-
-                            // stdoutBuf will be something like
-                            // something.tar.gz                                1% 2112KB   2.1MB/s   00:50 ETA
-                            // unless we exceed BUFSIZE. which will never happen. unless we get a horrendously long filename perhaps
-                    
-                            // fieldBuf is set to stdoutBuf, but with spaces replaced with char(0)s
-                            // fields[n] are the character positions of the nth field in fieldBuf
-                            strncpy(fieldBuf, stdoutBuf, STDOUT_BUFSIZE);
-                            int fieldIdx=0, fields[5], i=0;
-                            for (i=0; i<stdoutIdx; i++) {
-                                if (fieldBuf[i]==' ' || fieldBuf[i]=='\r') { 
-                                    fieldBuf[i]=0; 
-                                } else {
-                                    if (fieldIdx<5 && (i==0 || fieldBuf[i-1]==0)) {
-                                        fields[fieldIdx++]=i; 
-                                    }
-                                }
-                            }
-                    
-                            // right number of fields and a percentage character in the right place? 
-                            if (fieldIdx==5 && fieldBuf[fields[1] + strlen(&fieldBuf[fields[1]])-1]=='%') {
-                                fieldBuf[fields[1] + strlen(&fieldBuf[fields[1]])-1]=0;
-                                if (!shownStartTemplate) {
-                                    shownStartTemplate = 1;
-                                    printf("%s", startTemplate);
-                                }  
-                                printfmt(5, progressTemplate, &fieldBuf[fields[0]],
-                                  &fieldBuf[fields[1]],&fieldBuf[fields[2]],&fieldBuf[fields[3]],&fieldBuf[fields[4]]);
-                            } else {
-                                // don't generate empty lines on stdout
-                                if ((strncmp(stdoutBuf, "\n", STDOUT_BUFSIZE)!=0) &&
-                                    (strncmp(stdoutBuf, "\r", STDOUT_BUFSIZE)!=0) ) {
-                                    printfmt(1, stdoutTemplate, stdoutBuf);
-                                }   
-                            }
-                            fflush(stdout);
-                    
-                            stdoutIdx=0; 
-                        }
-                    }  
-                }  
-            }
-            
-            // reset set
-            FD_ZERO(&selectFds);
-            if (!doneStdout) { FD_SET(stdoutPtyFd, &selectFds); }
-            if (!doneStderr) { FD_SET(stderrPipeFd[0], &selectFds); }
-        }  
-
-        // both stdout & stderr have been closed, dump whatever's left
-        if (stderrIdx!=0) { stderrBuf[stderrIdx]=0; printfmt(1, stderrTemplate, stderrBuf); }
-        if (stdoutIdx!=0) { stdoutBuf[stdoutIdx]=0; printfmt(1, stdoutTemplate, stdoutBuf); }
-        fflush(stdout);
-        
-        // get the exit status of the scp process. 
-        pid_t w = waitpid (pid, &exitStatus, 0);
-        if (w==-1) { perror("waitpid"); exit(1); }
-        
-        if (WIFEXITED(exitStatus)) {
-          sprintf(stdoutBuf, "%d", WEXITSTATUS(exitStatus));
-          printfmt(1, endTemplate, stdoutBuf);
-          exit (WEXITSTATUS(exitStatus));  // propagate exitStatus
-          
-        } else if (WIFSIGNALED(exitStatus)) {
-          // display a signal as -(signal number)
-          sprintf(stdoutBuf, "-%d", WTERMSIG(exitStatus));
-          printfmt(1, endTemplate, stdoutBuf); 
-          exit (1);
-            
-        } else {
-          // something weird
-          exit (1);
-        }
-    }
-
-    // this should should never be executed 
-    exit (0);
-} 
\ No newline at end of file
+/* scpwrap.c
+ * 
+ * $Id$
+ *
+ * Wrapper for scp which translates progress text (e.g. "50%") 
+ * into javascript which generates/updates a progress bar.
+ *
+ * Call this thing from a bash script that dumps it's output directly into an iframe 
+ * which is surrounded by <script> elements.
+ *
+ * COMPILING
+ * 
+ * Remember to include the util library when compiling !
+ * The parsing code is in libscpwrap.c, so use the Makefile, or compile both; e.g.
+ *      gcc -Wl,--no-as-needed scpwrap.c libscpwrap.c -lutil -lm -oscpwrap
+ * 
+ * Modified from http://cwshep.blogspot.com/2009/06/showing-scp-progress-using-zenity.html
+ *
+ * Tempted to patch scp.c directly. Although scp.c will still display the progress bar if
+ * stderr is redirected to a non-tty 
+ * ( http://www.openbsd.org/cgi-bin/cvsweb/src/usr.bin/ssh/scp.c?rev=1.178;content-type=text%2Fx-cvsweb-markup )
+ *
+ * see http://www.linuxquestions.org/questions/programming-9/problem-with-child-process-658750/#post3229496
+       http://www.openbsd.org/cgi-bin/cvsweb/src/usr.bin/ssh/scp.c?rev=1.178;content-type=text%2Fx-cvsweb-markup
+       http://stackoverflow.com/questions/2605130/redirecting-exec-output-to-a-buffer-or-file
+       http://stackoverflow.com/questions/903864/how-to-exit-a-child-process-and-return-its-status-from-execvp
+ */
+
+#define _GNU_SOURCE                // for nftw()
+#include <unistd.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include "libscpwrap.h"
+#include "scpwrap-board.h"
+#include "scpwrap-delta.h"
+
+/* let's say that the things we're going to replace in here are:
+ * %f - filename
+ * %p - progress (0-100) and "%" character
+ * %t - transfer size ("2112KB")
+ * %s - speed ("2.1MB/s" or however progressmeter.c does things)
+ * %e - ETA ("--:--" or "05:23"), hh:mm:ss, or however progressmeter.c does things)
+ * %w - worker number (which scp process generated the event, in --parallel mode)
+ * %i - file number (incremented whenever an scp process starts copying another file)
+ * %B - bytes copied so far, in all files
+ * %T - total bytes to copy (from --total, or the size of local source files), or -1 if unknown
+ * %R - throughput in bytes per second (an exponentially weighted moving average)
+ * %E - ETA for all files, in seconds, or -1 if unknown
+ * %P - progress for all files (0-100), or -1 if unknown
+ * %a - attempt number of the scp process that's about to be retried (from 2)
+ * %r - reason that an scp process was killed by the watchdog ("stalled" or "slow")
+ * %D - delay before an scp process is retried, in seconds
+ * %h - destination host of the scp process ("" if it's copying to a local path)
+ * %F - number of scp processes (copy operations) that have finished
+ * %N - number of copy operations in all, or -1 if unknown
+ */
+
+// placeholders available in each type of template. The n'th character here corresponds
+// to the n'th field passed to scpwrap_template_render()
+#define STDOUT_PLACEHOLDERS "swih"
+#define STDERR_PLACEHOLDERS "swih"
+#define START_PLACEHOLDERS ""
+#define PROGRESS_PLACEHOLDERS "fptsewihBTREPFN"
+#define END_PLACEHOLDERS "cdFN"
+#define RETRY_PLACEHOLDERS "wiarDh"
+#define ALL_PLACEHOLDERS "fptsecdwiBTREParDhFN"
+
+// the SCPWRAP_PROGRESS_FIELDS fields parsed from a progress line (see libscpwrap.h) are 
+// followed by fields describing the scp process that generated an event; these also
+// follow the text field in stdout/stderr events
+#define FIELD_WORKER 5
+#define FIELD_FILEID 6
+#define FIELD_HOST 7
+// fields describing the progress of all files; these follow the worker fields in progress events
+#define FIELD_JOB_BYTES 8
+#define JOB_FIELDS 7
+#define MAX_FIELDS 15
+#define JOB_FIELD_MASK (((1u << JOB_FIELDS) - 1) << FIELD_JOB_BYTES)
+
+// throughput is sampled at most this often, and averaged with a time constant of RATE_EWMA_SECONDS
+#define RATE_SAMPLE_INTERVAL 0.5
+#define RATE_EWMA_SECONDS 5.0
+
+// initial size of the output buffers that events are rendered into
+#define STDOUT_BUFSIZE 4096
+
+// scp options that take an argument; used to find the source files in --parallel mode
+#define SCP_ARG_OPTIONS "cDFiJloPSX"
+
+// maximum number of events returned by each epoll_wait(); and the event data used for stdout
+// (other event data is the worker number * 2, + 1 for stderr)
+#define EPOLL_MAXEVENTS 64
+#define EPOLL_STDOUT 0xffffffff
+// event data used for the --listen server's epoll instance (in the main epoll instance), 
+// and for its listening socket (in its own epoll instance)
+#define EPOLL_SSE 0xfffffffe
+
+// stop reading from scp if this many bytes of output are waiting to be written to stdout
+#define OUTQ_MAXSIZE (1024*1024)
+// maximum number of runs of queued events to send in a single writev()
+#define OUTQ_IOVMAX 64
+// bytes reserved before each event in --binary mode for the frame length and type
+#define OUTQ_FRAME_PREFIX 2
+
+// --listen server: maximum number of bytes of events kept for clients that aren't keeping up,
+// maximum size of an HTTP request, and the number of seconds to keep sending to clients at the end
+#define SSE_MAXSIZE (1024*1024)
+#define SSE_REQUEST_MAXSIZE 8192
+#define SSE_LINGER 1.0
+// kinds of event sent by the --listen server
+#define SSE_START 0
+#define SSE_PROGRESS 1
+#define SSE_END 2
+
+// --record file format (see record_open()): magic number and version, and the kinds of record
+#define RECORD_MAGIC "scpwrap\x1a"
+#define RECORD_VERSION 2
+#define RECORD_STDOUT 0
+#define RECORD_STDERR 1
+#define RECORD_EXIT 2
+#define RECORD_RUN 3
+
+// exit code reported when the watchdog killed the last attempt of an scp process (as per timeout(1)),
+// and the number of seconds to wait after sending SIGTERM before sending SIGKILL
+#define WATCHDOG_EXIT 124
+#define WATCHDOG_KILL_GRACE 5.0
+#define WATCHDOG_WINDOW 30.0        // default --stall-timeout when only --min-speed is given
+
+// in --batch mode, SSH control connections close themselves once they've been idle for this
+// many seconds, in case scpwrap is killed before it can close them
+#define MASTER_PERSIST "60"
+
+// values for STATS_FORMAT
+#define STATS_NONE 0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+// number of --stats latency histogram buckets; bucket n counts events written within 2^n microseconds
+#define STATS_BUCKETS 24
+
+// set by --js or --json option to one of the SCPWRAP_ESCAPE_* values; stdout/stderr will be 
+// javascript-String or JSON-String escaped
+static int ESCAPE_MODE = SCPWRAP_ESCAPE_NONE;
+
+// values for DELTA_MODE
+#define DELTA_NONE 0
+#define DELTA_JS 1
+#define DELTA_JSON 2
+#define DELTA_BINARY 3
+
+// set by --delta or --binary; progress events only contain the fields that have changed
+static int DELTA_MODE = DELTA_NONE;
+
+// set by --parser, or from the --command name; parses the output of each process
+static const struct scpwrap_parser *PARSER = NULL;
+
+// file status flags of stdout before it was set to non-blocking mode
+static int STDOUT_FLAGS = -1;
+
+// set by --record; the output of each scp process is saved to this file
+static FILE *RECORD_FILE = NULL;
+// time that recording started (from now_secs()), and the time of the last record, in microseconds since then
+static double RECORD_START;
+static unsigned long long RECORD_USECS;
+
+/** Counters and timings reported by --stats. The counters are always updated, as that's
+   about as cheap as checking whether they're needed; anything that needs to read the
+   clock is only done if STATS_FORMAT is set */
+static struct stats {
+    unsigned long long reads;       // read() calls on scp stdout/stderr
+    unsigned long long writes;      // writev() calls on stdout
+    unsigned long long polls;       // epoll_wait() and select() calls
+    unsigned long long stdoutBytes, stderrBytes; // bytes read from scp stdout/stderr
+    unsigned long long outputBytes; // bytes written to stdout
+    unsigned long long progressLines, stdoutEvents, stderrEvents; // lines of each type
+    double pollTime;                // seconds spent waiting in epoll_wait() and select()
+    double writeTime;               // seconds spent in writev() calls
+    unsigned long long latency[STATS_BUCKETS + 1]; // events written n microseconds after their input was read, by log2(n)
+    double startTime;               // time that scpwrap started
+    double nextReport;              // time of the next --stats-interval report, or 0
+} STATS;
+// set by --stats; the format of the report
+static int STATS_FORMAT = STATS_NONE;
+// set by --stats-interval; seconds between reports, or 0 for a report at exit only
+static double STATS_INTERVAL = 0;
+
+/** stall watchdog settings (--stall-timeout, --min-speed, --retries and --retry-delay) */
+static struct watchdog {
+    double window;                  // seconds over which progress is measured, or 0 to disable the watchdog
+    double minSpeed;                // scp processes copying fewer bytes per second than this are killed
+    int retries;                    // number of times a killed scp process is retried
+    double retryDelay;              // seconds before the first retry; doubled for each subsequent retry
+} WATCHDOG = { 0, 0, 2, 1 };
+
+// set by --board; live progress is published in this memory-mapped file (see scpwrap-board.h)
+static struct board_header *BOARD = NULL;
+
+// templates, workers, the output queue and everything else that lasts for the whole run
+// are allocated from this arena; each worker's buffers come from an arena of its own
+static struct scpwrap_arena ARENA;
+
+// set by --ssh-command; the command used to open and close SSH control connections in --batch mode
+static char *SSH_COMMAND = "ssh";
+// set by --connect-timeout; seconds that opening an SSH control connection may take before the
+// host's files are copied without one, or 0 for ssh's default
+static int SSH_CONNECT_TIMEOUT = 10;
+
+/** an SSH control connection (ControlMaster) to a host, shared by the scp processes that
+   copy files to that host in --batch mode */
+static struct ssh_master {
+    char *host;                     // [user@]host, as it appears in destinations
+    char *target;                   // host as passed to ssh (without any IPv6 brackets)
+    char *pathOption;               // "ControlPath=..." option for ssh and scp
+    pid_t pid;                      // pid of the ssh process while it's connecting, or 0
+    int running;                    // set to 1 once the control connection is up
+} *MASTERS = NULL;
+static int NMASTERS = 0;
+// temporary directory containing the control sockets, or NULL
+static char *MASTER_DIR = NULL;
+
+static char* TXT_STDOUT_TEMPLATE = "";
+static char* TXT_STDERR_TEMPLATE = "";
+static char* TXT_START_TEMPLATE = "";
+static char* TXT_PROGRESS_TEMPLATE = "%p\n";
+static char* TXT_END_TEMPLATE = "";
+static char* TXT_RETRY_TEMPLATE = "";
+
+static char* JS_STDOUT_TEMPLATE = "ui.addOutput(\"%s\");\n";
+static char* JS_STDERR_TEMPLATE = "ui.addOutputError(\"%s\");\n";
+static char* JS_START_TEMPLATE = "var sp = ui.startScpProgress();\n";
+static char* JS_PROGRESS_TEMPLATE = "sp.setProgress(\"%f\", %p, \"%t\", \"%s\", \"%e\");\n";
+static char* JS_END_TEMPLATE = "ui.stopScpProgress(%c);\n";
+static char* JS_RETRY_TEMPLATE = "ui.addOutputError(\"scp %r; retrying in %D seconds (attempt %a)\");\n";
+
+static char* JSON_STDOUT_TEMPLATE = "{\"event\":\"stdout\",\"text\":\"%s\"}\n";
+static char* JSON_STDERR_TEMPLATE = "{\"event\":\"stderr\",\"text\":\"%s\"}\n";
+static char* JSON_START_TEMPLATE = "{\"event\":\"start\"}\n";
+static char* JSON_PROGRESS_TEMPLATE = "{\"event\":\"progress\",\"worker\":%w,\"id\":%i,\"file\":\"%f\",\"percent\":%p,\"size\":\"%t\",\"speed\":\"%s\",\"eta\":\"%e\"}\n";
+static char* JSON_END_TEMPLATE = "{\"event\":\"end\",\"exitCode\":%c,\"suppressed\":%d}\n";
+static char* JSON_RETRY_TEMPLATE = "{\"event\":\"retry\",\"worker\":%w,\"id\":%i,\"attempt\":%a,\"reason\":\"%r\",\"delay\":%D}\n";
+
+/** append an unsigned LEB128 varint to the output buffer */
+static void outbuf_varint(struct scpwrap_outbuf *ob, unsigned long long n) {
+    scpwrap_outbuf_reserve(ob, 10);
+    while (n >= 0x80) { ob->buf[ob->len++] = (char) ((n & 0x7f) | 0x80); n >>= 7; }
+    ob->buf[ob->len++] = (char) n;
+}
+
+/** turn the event at offset start in the output buffer (after OUTQ_FRAME_PREFIX bytes
+   reserved for the frame length and type) into a --binary frame of the given type 
+   (see scpwrap-delta.h). The event is only moved if its length doesn't fit in one byte */
+static void outbuf_frame(struct scpwrap_outbuf *ob, size_t start, int type) {
+    char prefix[11];
+    size_t n = 0, textLen = ob->len - start - OUTQ_FRAME_PREFIX, len = textLen + 1;
+    while (len >= 0x80) { prefix[n++] = (char) ((len & 0x7f) | 0x80); len >>= 7; }
+    prefix[n++] = (char) len;
+    prefix[n++] = (char) type;
+    if (n > OUTQ_FRAME_PREFIX) {
+        scpwrap_outbuf_reserve(ob, n - OUTQ_FRAME_PREFIX);
+        memmove(ob->buf + start + n, ob->buf + start + OUTQ_FRAME_PREFIX, textLen);
+        ob->len += n - OUTQ_FRAME_PREFIX;
+    }
+    memcpy(ob->buf + start, prefix, n);
+}
+
+/** return the current time from the monotonic clock, in seconds */
+double now_secs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** add an event written the given number of seconds after its input was read to the --stats latency histogram */
+static void stats_latency(double seconds) {
+    int bucket = 0;
+    if (seconds * 1e6 >= 1) { frexp(seconds * 1e6, &bucket); }
+    STATS.latency[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS]++;
+}
+
+/** Output queue. 
+
+   Rendered events are queued here and written to a non-blocking file descriptor 
+   by outq_write() as it becomes writable, so that a slow reader doesn't hold up 
+   the main loop. Events are written in the order they were queued, except that 
+   while the file descriptor isn't accepting everything written to it, a progress 
+   event replaces any progress event for the same file that hasn't been written 
+   yet; i.e. a slow reader only receives the latest progress.
+
+   Events are rendered straight into a single buffer, one after the other, so that
+   nothing is allocated per event, and runs of consecutive events are written with
+   a single iovec. The buffer is emptied whenever everything has been written, and
+   the space taken by written and replaced events is reclaimed by moving the rest 
+   back to the start of the buffer once it's more than half of the buffer.
+ */
+struct outq {
+    int fd;                   // file descriptor to write to
+    struct scpwrap_outbuf ob; // rendered events
+    struct outq_entry {
+        size_t start;         // offset of the event in ob
+        size_t len;           // length of the event; 0 if it has been replaced
+        int key;              // number of the file that a progress event is for, or -1 for other events
+        double time;          // time that the input that generated the event was read (for --stats)
+    } *entries;               // queued events, from entries[head]
+    int size;                 // allocated number of entries
+    int head;                 // index of the first queued event
+    int count;                // number of queued events (including the one being rendered)
+    size_t off;               // number of bytes of the first event already written
+    double inputTime;         // time that the input being processed was read (for --stats)
+    size_t bytes;             // number of bytes queued
+    unsigned long replaced;   // number of progress events replaced before they were written
+    int blocked;              // set to 1 if the last write couldn't write everything offered
+    int error;                // set to 1 if the file descriptor could not be written to
+    int framed;               // set to 1 to write each event as a --binary frame
+};
+
+/** initialise an output queue that writes to fd, which will be set to non-blocking mode,
+   allocated from arena. returns 0 on success, or -1 if the queue could not be allocated */
+int outq_init(struct outq *q, struct scpwrap_arena *arena, int fd) {
+    q->fd = fd;
+    q->size = OUTQ_IOVMAX;
+    q->entries = scpwrap_arena_alloc(arena, q->size * sizeof(struct outq_entry));
+    q->head = q->count = 0;
+    q->off = q->bytes = 0;
+    q->replaced = 0;
+    q->blocked = q->error = q->framed = 0;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return q->entries == NULL || scpwrap_outbuf_init(&q->ob, arena, STDOUT_BUFSIZE) == -1 ? -1 : 0;
+}
+
+/** move the queued events back to the start of the buffer, dropping any that were replaced */
+static void outq_compact(struct outq *q) {
+    struct outq_entry *e;
+    size_t len = 0;
+    int i, n = 0;
+    for (i=0; i<q->count; i++) {
+        e = &q->entries[q->head + i];
+        if (e->len == 0) { continue; }
+        memmove(q->ob.buf + len, q->ob.buf + e->start, e->len);
+        e->start = len;
+        len += e->len;
+        q->entries[n++] = *e;
+    }
+    q->head = 0;
+    q->count = n;
+    q->ob.len = len;
+}
+
+int outq_write(struct outq *q);
+
+/** start a new event at the end of the output queue; returns the buffer to render 
+   it into, which the event should be appended to. The event is queued when 
+   outq_commit() is called */
+struct scpwrap_outbuf *outq_begin(struct outq *q) {
+    struct outq_entry *e;
+    // a single read can produce more events than there are entries, or than fit in the 
+    // buffer; write them rather than growing the queue, which only needs to grow while 
+    // the file descriptor is blocked
+    if (q->count > 0 && !q->blocked && ((q->head + q->count == q->size && q->head == 0) || 
+        q->ob.len > q->ob.size / 2)) { 
+        outq_write(q); 
+    }
+    if (q->count == 0) {
+        q->head = 0;
+        q->ob.len = 0;
+    } else if (q->ob.len > STDOUT_BUFSIZE && q->ob.len - q->bytes - q->off > q->ob.len / 2) {
+        outq_compact(q);
+    }
+    if (q->head + q->count == q->size) {
+        if (q->head > 0) {
+            memmove(q->entries, q->entries + q->head, q->count * sizeof(struct outq_entry));
+            q->head = 0;
+        } else {
+            q->entries = scpwrap_arena_grow(q->ob.arena, q->entries, q->size * sizeof(struct outq_entry), 
+                q->size * 2 * sizeof(struct outq_entry));
+            if (q->entries == NULL) { perror("realloc"); exit(1); }
+            q->size *= 2;
+        }
+    }
+    e = &q->entries[q->head + q->count];
+    e->start = q->ob.len;
+    e->len = 0;
+    e->key = -1;
+    e->time = q->inputTime;
+    q->count++;
+    // leave room for the frame length and type, which fit in 2 bytes unless the event is long
+    if (q->framed) { scpwrap_outbuf_append(&q->ob, "\0\0", OUTQ_FRAME_PREFIX); }
+    return &q->ob;
+}
+
+/** return the text of the event being rendered (excluding any --binary frame prefix),
+   and store its length in *len */
+const char *outq_rendered(struct outq *q, size_t *len) {
+    size_t start = q->entries[q->head + q->count - 1].start + (q->framed ? OUTQ_FRAME_PREFIX : 0);
+    *len = q->ob.len - start;
+    return q->ob.buf + start;
+}
+
+/** queue the event started by outq_begin(). If key is not -1, the event is a progress 
+   event for the file numbered key; if the file descriptor isn't keeping up, it replaces 
+   any unwritten progress event for that file */
+void outq_commit(struct outq *q, int key) {
+    struct outq_entry *e = &q->entries[q->head + q->count - 1], *o;
+    int i;
+    if (q->framed) {
+        if (q->ob.len == e->start + OUTQ_FRAME_PREFIX) { 
+            q->ob.len = e->start;  // empty events aren't written
+        } else {
+            outbuf_frame(&q->ob, e->start, key != -1 ? DELTA_PROGRESS : DELTA_TEXT); 
+        }
+    }
+    if (q->error) {
+        // nothing more can be written, so the event is discarded
+        q->ob.len = e->start;
+        q->count--;
+        return;
+    }
+    e->len = q->ob.len - e->start;
+    e->key = key;
+    if (key != -1) {
+        // don't replace the first event if it has been partially written
+        for (i = (q->off > 0 ? 1 : 0); q->blocked && i < q->count - 1; i++) {
+            o = &q->entries[q->head + i];
+            if (o->key == key && o->len > 0) {
+                q->bytes -= o->len;
+                o->len = 0;
+                q->replaced++;
+            }
+        }
+    }
+    q->bytes += e->len;
+}
+
+/** discard all queued events, and any that are queued later, as the file descriptor 
+   can't be written to (or its reader has gone) */
+void outq_fail(struct outq *q) {
+    q->error = 1;
+    q->head = q->count = 0;
+    q->off = q->bytes = 0;
+    q->ob.len = 0;
+}
+
+/** returns 1 if there are events waiting to be written */
+int outq_pending(struct outq *q) {
+    return q->bytes > 0;
+}
+
+/** returns 1 if the output queue has grown large enough that no more input should be read */
+int outq_full(struct outq *q) {
+    return q->bytes >= OUTQ_MAXSIZE;
+}
+
+/** write as many queued events as possible without blocking, using as few writev() calls
+   as possible. If the file descriptor can't be written to, then all queued events are 
+   discarded.
+   returns 0 on success, or -1 if the write failed */
+int outq_write(struct outq *q) {
+    struct iovec iov[OUTQ_IOVMAX];
+    struct outq_entry *e;
+    int i, niov;
+    ssize_t n;
+    size_t len, total;
+    char *p;
+    double start = 0, now = 0;
+
+    while (q->bytes > 0 && !q->error) {
+        for (i = 0, niov = 0, total = 0; i < q->count && niov < OUTQ_IOVMAX; i++) {
+            e = &q->entries[q->head + i];
+            if (e->len == 0) { continue; }
+            p = q->ob.buf + e->start + (i == 0 ? q->off : 0);
+            len = e->len - (i == 0 ? q->off : 0);
+            // consecutive events are contiguous, unless an event between them was replaced
+            if (niov > 0 && (char *) iov[niov-1].iov_base + iov[niov-1].iov_len == p) {
+                iov[niov-1].iov_len += len;
+            } else {
+                iov[niov].iov_base = p;
+                iov[niov].iov_len = len;
+                niov++;
+            }
+            total += len;
+        }
+        if (STATS_FORMAT != STATS_NONE) { start = now_secs(); }
+        n = writev(q->fd, iov, niov);
+        STATS.writes++;
+        if (STATS_FORMAT != STATS_NONE) { now = now_secs(); STATS.writeTime += now - start; }
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) { q->blocked = 1; return 0; }
+            outq_fail(q);
+            break;
+        }
+        q->blocked = (size_t) n < total;
+        q->bytes -= n;
+        STATS.outputBytes += n;
+        // remove completely written events from the head of the queue
+        while (q->count > 0) {
+            e = &q->entries[q->head];
+            len = e->len - q->off;
+            if (e->len > 0 && (size_t) n < len) { q->off += n; break; }
+            if (e->len > 0) { 
+                n -= len; 
+                if (STATS_FORMAT != STATS_NONE) { stats_latency(now - e->time); }
+            }
+            q->off = 0;
+            q->head++;
+            q->count--;
+        }
+        if (q->blocked) { break; }
+    }
+    return q->error ? -1 : 0;
+}
+
+/** write queued events, blocking until no more than maxBytes remain to be written */
+void outq_drain(struct outq *q, size_t maxBytes) {
+    fd_set writeFds;
+    double start = 0;
+    while (q->bytes > maxBytes && !q->error) {
+        FD_ZERO(&writeFds);
+        FD_SET(q->fd, &writeFds);
+        if (STATS_FORMAT != STATS_NONE) { start = now_secs(); }
+        STATS.polls++;
+        if (select(q->fd + 1, NULL, &writeFds, NULL, NULL) == -1 && errno != EINTR) { 
+            perror("select()"); return; 
+        }
+        if (STATS_FORMAT != STATS_NONE) { STATS.pollTime += now_secs() - start; }
+        outq_write(q);
+    }
+}
+
+/** Server-Sent Events server (--listen).
+
+   Start, progress and end events are each encoded once as an SSE frame, and appended
+   to a stream buffer that is shared by every client; each client only keeps its 
+   position in the stream. The latest start frame, progress frame for each worker, 
+   and end frame are also kept, so that a client that connects late (or falls more 
+   than SSE_MAXSIZE bytes behind) is sent the current state, and then continues 
+   from the end of the stream.
+ */
+struct sse {
+    int listenFd;                   // listening socket, or -1 if --listen wasn't used
+    int epfd;                       // epoll instance for the listening socket and clients
+    char *unixPath;                 // path of a unix-domain listening socket, removed on exit, or NULL
+    struct scpwrap_outbuf stream;   // encoded frames that haven't been sent to every client yet
+    unsigned long long base;        // stream position of stream.buf[0]
+    struct scpwrap_outbuf *state;   // latest start frame, progress frame for each worker, and end frame
+    int nstate;
+    struct sse_client {
+        int fd;                     // client socket, or -1 if this entry is unused
+        struct scpwrap_outbuf buf;  // HTTP request while it's being read; then the response header and current state
+        size_t off;                 // number of bytes of buf already sent
+        unsigned long long pos;     // stream position of the next byte to send
+        int streaming;              // set to 1 once the request has been read
+        int events;                 // epoll events being watched
+    } *clients;
+    int clientsSize;
+};
+
+/** start listening for HTTP connections on addr, which is "[host:]port" (the host 
+   defaults to 127.0.0.1), or "unix:path". nworkers is the number of workers that
+   progress events will be published for.
+   returns 0 on success, or -1 if the socket could not be created */
+int sse_listen(struct sse *s, const char *addr, int nworkers) {
+    struct addrinfo hints = { 0 }, *ai = NULL;
+    struct sockaddr_un sun = { 0 };
+    struct epoll_event ev;
+    struct stat sb;
+    char host[256];
+    const char *port, *colon = strrchr(addr, ':');
+    int i, one = 1;
+
+    if (strncmp(addr, "unix:", 5) == 0) {
+        if (strlen(addr + 5) >= sizeof(sun.sun_path)) { fprintf(stderr, "--listen path is too long\n"); return -1; }
+        sun.sun_family = AF_UNIX;
+        strcpy(sun.sun_path, addr + 5);
+        // replace a socket left behind by an earlier run, but not any other kind of file
+        if (stat(sun.sun_path, &sb) == 0 && S_ISSOCK(sb.st_mode)) { unlink(sun.sun_path); }
+        s->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s->listenFd == -1 || bind(s->listenFd, (struct sockaddr *) &sun, sizeof(sun)) == -1) { 
+            perror(addr); return -1; 
+        }
+        s->unixPath = strdup(sun.sun_path);
+    } else {
+        // "[::1]:8080", "localhost:8080" or "8080"
+        if (colon == NULL) {
+            strcpy(host, "127.0.0.1"); port = addr;
+        } else if (colon - addr >= (int) sizeof(host)) {
+            fprintf(stderr, "--listen host is too long\n"); return -1;
+        } else {
+            i = addr[0] == '[' && colon[-1] == ']' ? 1 : 0;
+            memcpy(host, addr + i, colon - addr - i * 2);
+            host[colon - addr - i * 2] = 0;
+            port = colon + 1;
+        }
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if ((i = getaddrinfo(host, port, &hints, &ai)) != 0) {
+            fprintf(stderr, "%s: %s\n", addr, gai_strerror(i)); return -1;
+        }
+        s->listenFd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s->listenFd != -1) { setsockopt(s->listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); }
+        if (s->listenFd == -1 || bind(s->listenFd, ai->ai_addr, ai->ai_addrlen) == -1) { 
+            perror(addr); freeaddrinfo(ai); return -1; 
+        }
+        freeaddrinfo(ai);
+    }
+    if (listen(s->listenFd, 16) == -1) { perror("listen"); return -1; }
+
+    s->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (s->epfd == -1) { perror("epoll_create1"); return -1; }
+    ev.events = EPOLLIN;
+    ev.data.u32 = EPOLL_SSE;
+    epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->listenFd, &ev);
+
+    s->nstate = nworkers + 2;
+    s->state = scpwrap_arena_alloc(&ARENA, s->nstate * sizeof(struct scpwrap_outbuf));
+    if (s->state == NULL || scpwrap_outbuf_init(&s->stream, &ARENA, STDOUT_BUFSIZE) == -1) { perror("malloc"); exit(1); }
+    for (i=0; i<s->nstate; i++) {
+        if (scpwrap_outbuf_init(&s->state[i], &ARENA, 256) == -1) { perror("malloc"); exit(1); }
+    }
+    return 0;
+}
+
+/** returns the number of bytes from stream position pos to the end of the frame it is in,
+   or 0 if pos is at the start of a frame. Frames end with a blank line, and sse_flush() 
+   keeps the 2 bytes before the slowest client's position, so that this can be checked */
+static size_t sse_frame_rest(struct sse *s, unsigned long long pos) {
+    const char *p = s->stream.buf + (pos - s->base), *end;
+    // the base is at the start of a frame unless it's at least 2 bytes before every client
+    if (pos == s->base || (pos - s->base >= 2 && p[-2] == '\n' && p[-1] == '\n')) { return 0; }
+    end = memmem(p - 1, s->stream.len - (pos - s->base) + 1, "\n\n", 2);
+    return end + 2 - p;
+}
+
+/** publish an event rendered by the start (kind SSE_START), progress (SSE_PROGRESS) or
+   end (SSE_END) templates to the --listen server's clients. Each line of the event
+   becomes a "data:" line of the SSE frame */
+void sse_publish(struct sse *s, int kind, int workerId, const char *text, size_t len) {
+    struct scpwrap_outbuf *frame;
+    size_t i, n, start = 0;
+    if (s->listenFd == -1 || len == 0) { return; }
+    frame = &s->state[kind == SSE_START ? 0 : kind == SSE_END ? s->nstate - 1 : workerId + 1];
+    frame->len = 0;
+    if (text[len - 1] == '\n') { len--; }
+    for (i = 0; i <= len; i++) {
+        if (i == len || text[i] == '\n' || text[i] == '\r') {
+            scpwrap_outbuf_append(frame, "data: ", 6);
+            scpwrap_outbuf_append(frame, text + start, i - start);
+            scpwrap_outbuf_append(frame, "\n", 1);
+            start = i + 1;
+        }
+    }
+    scpwrap_outbuf_append(frame, "\n", 1);
+
+    // if the slowest client is too far behind, drop what it hasn't read; it will be sent the current state instead
+    if (s->stream.len + frame->len > SSE_MAXSIZE) {
+        // finish any frame that a client has been sent part of, so that the state follows a whole frame
+        for (i = 0; i < (size_t) s->clientsSize; i++) {
+            struct sse_client *c = &s->clients[i];
+            if (c->fd == -1 || !c->streaming || c->pos >= s->base + s->stream.len) { continue; }
+            n = sse_frame_rest(s, c->pos);
+            scpwrap_outbuf_append(&c->buf, s->stream.buf + (c->pos - s->base), n);
+            c->pos += n;
+        }
+        s->base += s->stream.len;
+        s->stream.len = 0;
+    }
+    scpwrap_outbuf_append(&s->stream, frame->buf, frame->len);
+}
+
+/** close a client connection */
+static void sse_client_close(struct sse_client *c) {
+    close(c->fd);   // also removes it from the epoll instance
+    c->fd = -1;
+}
+
+/** queue the current state for a client that has just connected or fallen behind, 
+   and continue from the end of the stream */
+static void sse_client_resync(struct sse *s, struct sse_client *c) {
+    int i;
+    for (i=0; i<s->nstate; i++) { scpwrap_outbuf_append(&c->buf, s->state[i].buf, s->state[i].len); }
+    c->pos = s->base + s->stream.len;
+}
+
+/** send as much as possible to a client without blocking */
+static void sse_client_write(struct sse *s, struct sse_client *c) {
+    struct epoll_event ev;
+    ssize_t n = 0;
+    size_t len;
+    if (c->pos < s->base) { sse_client_resync(s, c); }
+    while (c->off < c->buf.len) {
+        n = send(c->fd, c->buf.buf + c->off, c->buf.len - c->off, MSG_NOSIGNAL);
+        if (n <= 0) { break; }
+        c->off += n;
+    }
+    if (c->off == c->buf.len) {
+        c->off = c->buf.len = 0;
+        while ((len = s->base + s->stream.len - c->pos) > 0) {
+            n = send(c->fd, s->stream.buf + (c->pos - s->base), len, MSG_NOSIGNAL);
+            if (n <= 0) { break; }
+            c->pos += n;
+        }
+    }
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { 
+        sse_client_close(c);
+        return;
+    }
+    // only wait for the socket to become writable if there's something left to send
+    ev.events = EPOLLIN | (c->off < c->buf.len || c->pos < s->base + s->stream.len ? EPOLLOUT : 0);
+    if (ev.events != (unsigned) c->events) {
+        ev.data.u32 = c - s->clients;
+        epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = ev.events;
+    }
+}
+
+/** read a client's HTTP request; once it's complete, start sending the event stream */
+static void sse_client_read(struct sse *s, struct sse_client *c) {
+    static const char *OK_HEADER = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\nConnection: close\r\n\r\n";
+    static const char *ERROR_HEADER = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\n"
+        "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    char buf[1024];
+    ssize_t n = read(c->fd, buf, sizeof(buf));
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) { return; }
+    if (n <= 0 || (!c->streaming && c->buf.len + n > SSE_REQUEST_MAXSIZE)) { sse_client_close(c); return; }
+    if (c->streaming) { return; }  // ignore anything else the client sends
+    scpwrap_outbuf_append(&c->buf, buf, n);
+    scpwrap_outbuf_append(&c->buf, "", 1);  // NUL-terminate for strstr()
+    c->buf.len--;
+    if (strstr(c->buf.buf, "\r\n\r\n") == NULL && strstr(c->buf.buf, "\n\n") == NULL) { return; }
+    if (strncmp(c->buf.buf, "GET ", 4) != 0) {
+        send(c->fd, ERROR_HEADER, strlen(ERROR_HEADER), MSG_NOSIGNAL);
+        sse_client_close(c);
+        return;
+    }
+    c->buf.len = 0;
+    scpwrap_outbuf_append(&c->buf, OK_HEADER, strlen(OK_HEADER));
+    sse_client_resync(s, c);
+    c->streaming = 1;
+    sse_client_write(s, c);
+}
+
+/** accept new connections, and read from or write to clients, without blocking */
+void sse_service(struct sse *s) {
+    struct epoll_event events[EPOLL_MAXEVENTS], ev;
+    struct sse_client *c;
+    int i, j, n, fd;
+    if (s->listenFd == -1) { return; }
+    n = epoll_wait(s->epfd, events, EPOLL_MAXEVENTS, 0);
+    for (i=0; i<n; i++) {
+        if (events[i].data.u32 == EPOLL_SSE) {
+            while ((fd = accept4(s->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                for (j=0; j<s->clientsSize && s->clients[j].fd != -1; j++) { }
+                if (j == s->clientsSize) {
+                    int newSize = s->clientsSize * 2 + 4;
+                    s->clients = realloc(s->clients, newSize * sizeof(struct sse_client));
+                    if (s->clients == NULL) { perror("realloc"); exit(1); }
+                    memset(s->clients + s->clientsSize, 0, (newSize - s->clientsSize) * sizeof(struct sse_client));
+                    for (; s->clientsSize < newSize; s->clientsSize++) { s->clients[s->clientsSize].fd = -1; }
+                }
+                c = &s->clients[j];
+                c->fd = fd;
+                if (c->buf.buf == NULL && scpwrap_outbuf_init(&c->buf, NULL, 1024) == -1) { perror("malloc"); exit(1); }
+                c->buf.len = c->off = 0;
+                c->streaming = 0;
+                c->events = ev.events = EPOLLIN;
+                ev.data.u32 = j;
+                epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+            }
+            continue;
+        }
+        c = &s->clients[events[i].data.u32];
+        if (c->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) { sse_client_read(s, c); }
+        if (c->fd != -1 && c->streaming && (events[i].events & EPOLLOUT)) { sse_client_write(s, c); }
+    }
+}
+
+/** send newly published events to every client, and discard the part of the stream 
+   that every client has been sent */
+void sse_flush(struct sse *s) {
+    unsigned long long minPos = s->base + s->stream.len;
+    int i;
+    for (i=0; i<s->clientsSize; i++) {
+        struct sse_client *c = &s->clients[i];
+        if (c->fd == -1 || !c->streaming) { continue; }
+        sse_client_write(s, c);
+        if (c->fd != -1 && c->pos < minPos) { minPos = c->pos; }
+    }
+    // keep the 2 bytes before minPos, so that sse_frame_rest() can tell if it's at the start of a frame
+    if (minPos > s->base + 2) {
+        minPos -= 2;
+        memmove(s->stream.buf, s->stream.buf + (minPos - s->base), s->base + s->stream.len - minPos);
+        s->stream.len -= minPos - s->base;
+        s->base = minPos;
+    }
+}
+
+/** send the remaining events to each client, waiting up to linger seconds for slow clients,
+   then close the --listen server */
+void sse_close(struct sse *s, double linger) {
+    double deadline = now_secs() + linger, t;
+    int i, pending;
+    if (s->listenFd == -1) { return; }
+    close(s->listenFd);
+    do {
+        sse_flush(s);
+        for (i=0, pending=0; i<s->clientsSize; i++) {
+            struct sse_client *c = &s->clients[i];
+            if (c->fd != -1 && c->streaming && (c->off < c->buf.len || c->pos < s->base + s->stream.len)) { pending = 1; }
+        }
+        t = deadline - now_secs();
+        if (pending && t > 0) {
+            struct epoll_event events[EPOLL_MAXEVENTS];
+            epoll_wait(s->epfd, events, EPOLL_MAXEVENTS, (int) (t * 1000) + 1);
+        }
+    } while (pending && t > 0);
+    for (i=0; i<s->clientsSize; i++) {
+        if (s->clients[i].fd != -1) { sse_client_close(&s->clients[i]); }
+    }
+    if (s->unixPath != NULL) { unlink(s->unixPath); }
+    s->listenFd = -1;
+}
+
+/** a copy of the fields of a progress event */
+struct frame {
+    struct scpwrap_arena *arena;    // arena that buf is allocated from
+    char *buf;                      // field text
+    size_t size;                    // allocated size of buf
+    struct scpwrap_field fv[SCPWRAP_PROGRESS_FIELDS];
+    int percent;                    // numeric value of the percent field
+};
+
+/** Progress event coalescing. 
+
+   Progress events that are identical to the last event emitted for a file are dropped,
+   and events that arrive less than minInterval seconds after the last event emitted, or 
+   that change the percentage by less than minDelta, are held back. The most recent
+   held-back event is kept as pending, and is emitted when a different file starts, when 
+   scp prints anything else, when the interval expires, or at the end of the transfer; so 
+   the first, last and 100% events for each file are always emitted.
+ */
+struct coalescer {
+    double minInterval;             // minimum seconds between events for a file (1 / --max-rate), or 0
+    int minDelta;                   // minimum change in percent between events for a file (--min-delta)
+    struct frame last;              // last event emitted for the current file
+    struct frame pending;           // most recent event held back for the current file
+    int hasLast, hasPending;
+    double lastTime;                // time that last was emitted
+    unsigned long received;         // number of progress events parsed
+    unsigned long emitted;          // number of progress events emitted
+};
+
+/** progress of all files being copied, in all workers */
+struct job {
+    double total;                   // total bytes to copy, or -1 if unknown
+    double bytes;                   // bytes copied so far
+    double rate;                    // smoothed throughput, in bytes per second, or -1 if not known yet
+    double scpRate;                 // sum of the speeds reported by each scp process
+    double sampleTime;              // time of the last throughput sample
+    double sampleBytes;             // bytes copied at the last throughput sample
+    int copies;                     // number of scp processes (copy operations) to run, or -1 if unknown
+    int copiesFinished;             // number of those that have finished
+    char text[JOB_FIELDS][24];      // values of the %B, %T, %R, %E, %P, %F and %N placeholders
+    int textValid;                  // set to 1 if text is up to date
+};
+
+/** compiled templates and the output queue they're rendered into */
+struct emitter {
+    struct outq q;
+    struct sse sse;                 // --listen server
+    struct scpwrap_template startTpl, stdoutTpl, stderrTpl, progressTpl, endTpl, retryTpl;
+    struct scpwrap_outbuf sseBuf;   // progress events rendered for the --listen server in --delta mode
+    int shownStartTemplate;         // set to 1 when startTemplate is rendered
+    int fileCount;                  // number of files that scp processes have started copying
+    struct job job;                 // progress of all files
+    double now;                     // time that the output being parsed was read
+};
+
+/** An scp child process, and the state used to parse its output. 
+
+   In --parallel (or --batch) mode there is one worker for each concurrent scp process; 
+   each worker runs scp for one source (or copy operation) at a time, taking the next 
+   one from the shared list when it finishes. Otherwise there is a single worker.
+ */
+struct worker {
+    int id;                         // worker number, from 0
+    pid_t pid;                      // pid of scp child process, or 0 if idle
+    char **args;                    // arguments for the scp process (including "scp" itself)
+    const char *host;               // destination host of the scp process, or "" (%h)
+    size_t hostLen;
+    int stdoutPtyFd;                // file descriptor for the master side of the stdout pseudoterminal
+    int stderrPipeFd;               // reading end of the pipe used to read stderr
+    struct scpwrap_arena arena;     // arena that the stream's buffers and the coalescer's frames are allocated from
+    struct scpwrap_stream stream;   // stdout/stderr capture buffers, and progress meter parser state
+    struct emitter *em;             // emitter that the worker's events are rendered by
+    struct coalescer co;            // progress event coalescing state
+    char idText[12];                // worker number text
+    size_t idLen;
+    int fileId;                     // number of the file currently being copied, or -1
+    char fileIdText[12];            // fileId as text
+    size_t fileIdLen;
+    double fileBytes;               // bytes copied so far in the current file
+    double fileRate;                // speed of the current file, as reported by scp
+    int exitCode;                   // exit code of the last scp process, or -(signal number)
+    double attemptBytes;            // bytes copied by the current scp process, in all files
+    int attempt;                    // number of times the current scp process has been started
+    double checkTime;               // start of the current watchdog window
+    double checkBytes;              // attemptBytes at checkTime
+    double killTime;                // time that the watchdog sent SIGTERM to the scp process, or 0
+    const char *killReason;         // why the watchdog killed the scp process, or NULL
+    double retryTime;               // time to start the next attempt of a killed scp process, or 0
+    struct frame delta;             // last progress event written in --delta mode
+    int deltaValid;                 // set to 1 if delta is for the current file
+};
+
+/** a source copied by its own scp process, in --parallel or --batch mode */
+struct copy_op {
+    char *source;
+    char *dest;
+    const char *host;               // destination host, or "" if it's a local path (%h)
+    int master;                     // index of the control connection to the host in MASTERS, or -1
+};
+
+/** copy the fields of a progress event, whose percent field has the value percent, into a frame */
+static void frame_copy(struct frame *f, const struct scpwrap_field *fv, int percent) {
+    size_t len = 0, off = 0;
+    int i;
+    for (i=0; i<SCPWRAP_PROGRESS_FIELDS; i++) { len += fv[i].len; }
+    if (len > f->size) {
+        // grown to the longest event for any file, so only allocates for the first few events
+        f->buf = scpwrap_arena_grow(f->arena, f->buf, f->size, len < 64 ? 64 : len);
+        if (f->buf == NULL) { perror("malloc"); exit(1); }
+        f->size = len < 64 ? 64 : len;
+    }
+    for (i=0; i<SCPWRAP_PROGRESS_FIELDS; i++) {
+        memcpy(f->buf + off, fv[i].str, fv[i].len);
+        f->fv[i].str = f->buf + off;
+        f->fv[i].len = fv[i].len;
+        off += fv[i].len;
+    }
+    f->percent = percent;
+}
+
+/** returns the numeric value of the percent field of a progress event, which
+   isn't necessarily NUL-terminated */
+static int field_percent(const struct scpwrap_field *fv) {
+    const char *p = fv[SCPWRAP_FIELD_PERCENT].str, *end = p + fv[SCPWRAP_FIELD_PERCENT].len;
+    int percent = 0;
+    for (; p < end && *p == ' '; p++) { }
+    for (; p < end && *p >= '0' && *p <= '9'; p++) { percent = percent * 10 + (*p - '0'); }
+    return percent;
+}
+
+/** returns 1 if field a has the same value as field b */
+static int field_equals(const struct scpwrap_field *a, const struct scpwrap_field *b) {
+    return a->len == b->len && memcmp(a->str, b->str, a->len) == 0;
+}
+
+/** Decide whether a progress event should be emitted. 
+
+   percent is the value of the event's percent field.
+   returns 1 if the event should be emitted now, or 0 if it has been dropped or held back.
+   The caller must first call coalesce_flush() if the event is for a different file 
+   (see coalesce_same_file())
+ */
+int coalesce_accept(struct coalescer *co, const struct scpwrap_field *fv, int percent, double now) {
+    int i, same = 1;
+    co->received++;
+    if (co->hasLast) {
+        for (i=0; i<SCPWRAP_PROGRESS_FIELDS && same; i++) { same = field_equals(&fv[i], &co->last.fv[i]); }
+        if (same) {
+            // nothing has changed since the last event emitted, so anything pending is stale
+            co->hasPending = 0; 
+            return 0;
+        }
+        if (!(percent >= 100 && co->last.percent < 100) &&
+            (abs(percent - co->last.percent) < co->minDelta || now - co->lastTime < co->minInterval)) {
+            frame_copy(&co->pending, fv, percent);
+            co->hasPending = 1;
+            return 0;
+        }
+    }
+    frame_copy(&co->last, fv, percent);
+    co->hasLast = 1;
+    co->hasPending = 0;
+    co->lastTime = now;
+    co->emitted++;
+    return 1;
+}
+
+/** returns 1 if the progress event is for the same file as the last event emitted */
+int coalesce_same_file(struct coalescer *co, const struct scpwrap_field *fv) {
+    return co->hasLast && field_equals(&fv[SCPWRAP_FIELD_FILENAME], &co->last.fv[SCPWRAP_FIELD_FILENAME]);
+}
+
+/** return the fields of the pending event for the current file, which should then 
+   be emitted, or NULL if there is no pending event. If endOfFile is set, then 
+   subsequent events will be treated as being for a new file */
+struct scpwrap_field *coalesce_flush(struct coalescer *co, double now, int endOfFile) {
+    struct frame tmp;
+    if (endOfFile) { co->hasLast = 0; }
+    if (!co->hasPending) { return NULL; }
+    // swap pending into last, so the returned fields remain valid until the next event
+    tmp = co->last; co->last = co->pending; co->pending = tmp;
+    co->hasPending = 0;
+    co->lastTime = now;
+    co->emitted++;
+    return co->last.fv;
+}
+
+/** return the number of seconds until the pending event should be emitted, or
+   -1 if there is no pending event that will become due without further input */
+double coalesce_timeout(struct coalescer *co, double now) {
+    double t;
+    if (!co->hasPending || co->minInterval == 0 || 
+        abs(co->pending.percent - co->last.percent) < co->minDelta) { return -1; }
+    t = co->lastTime + co->minInterval - now;
+    return t < 0 ? 0 : t;
+}
+
+/** record the number of bytes copied so far in a worker's current file, and the speed reported by scp */
+void job_file_progress(struct job *j, struct worker *w, double fileBytes, double fileRate, double now) {
+    double dt;
+    j->bytes += fileBytes - w->fileBytes;
+    w->attemptBytes += fileBytes - w->fileBytes;
+    j->scpRate += fileRate - w->fileRate;
+    w->fileBytes = fileBytes;
+    w->fileRate = fileRate;
+    j->textValid = 0;
+
+    // update the smoothed throughput
+    dt = now - j->sampleTime;
+    if (dt >= RATE_SAMPLE_INTERVAL) {
+        double sample = (j->bytes - j->sampleBytes) / dt;
+        if (j->rate < 0) {
+            j->rate = sample;
+        } else {
+            j->rate += (1 - exp(-dt / RATE_EWMA_SECONDS)) * (sample - j->rate);
+        }
+        j->sampleTime = now;
+        j->sampleBytes = j->bytes;
+    }
+}
+
+/** calculate the throughput, ETA in seconds (or -1 if unknown) and progress amount 
+   (0-100, or -1 if unknown) for all files */
+static void job_estimate(struct job *j, double *rate, double *eta, int *percent) {
+    double remaining = j->total - j->bytes;
+    // until there's enough data for a throughput sample, use the speeds reported by scp
+    *rate = j->rate < 0 ? j->scpRate : j->rate;
+    *eta = j->total < 0 || *rate <= 0 ? -1 : ceil((remaining < 0 ? 0 : remaining) / *rate);
+    *percent = j->total < 0 ? -1 : j->total == 0 ? 100 : (int) (j->bytes >= j->total ? 100 : j->bytes * 100 / j->total);
+}
+
+/** set the %B, %T, %R, %E, %P, %F and %N fields for the progress of all files */
+void job_fields(struct job *j, struct scpwrap_field *fv) {
+    double rate, eta;
+    int i, percent;
+    if (!j->textValid) {
+        job_estimate(j, &rate, &eta, &percent);
+        sprintf(j->text[0], "%.0f", j->bytes);
+        sprintf(j->text[1], "%.0f", j->total);
+        sprintf(j->text[2], "%.0f", rate);
+        sprintf(j->text[3], "%.0f", eta);
+        sprintf(j->text[4], "%d", percent);
+        sprintf(j->text[5], "%d", j->copiesFinished);
+        sprintf(j->text[6], "%d", j->copies);
+        j->textValid = 1;
+    }
+    for (i=0; i<JOB_FIELDS; i++) {
+        fv[i].str = j->text[i];
+        fv[i].len = strlen(j->text[i]);
+    }
+}
+
+// total size of the files found by nftw() in source_size()
+static double NFTW_TOTAL;
+
+static int nftw_size(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    if (typeflag == FTW_F) { NFTW_TOTAL += sb->st_size; }
+    return 0;
+}
+
+/** return the size of a local source file (or the total size of the files in a source directory),
+   or -1 if the source is a remote file, or can't be read */
+double source_size(const char *source) {
+    struct stat sb;
+    const char *colon = strchr(source, ':');
+    // as per scp, "host:file" is remote unless there's a '/' before the ':'
+    if (colon != NULL && (strchr(source, '/') == NULL || strchr(source, '/') > colon)) { return -1; }
+    if (stat(source, &sb) == -1) { return -1; }
+    if (S_ISDIR(sb.st_mode)) {
+        NFTW_TOTAL = 0;
+        if (nftw(source, nftw_size, 16, FTW_PHYS) == -1) { return -1; }
+        return NFTW_TOTAL;
+    }
+    return sb.st_size;
+}
+
+/** create the --board file, with a slot for each worker, and map it into memory.
+   exits if the file could not be created */
+void board_open(const char *filename, int nworkers, double total) {
+    size_t size = board_size(nworkers);
+    int i, fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) == -1) { perror(filename); exit(1); }
+    BOARD = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (BOARD == MAP_FAILED) { perror("mmap"); exit(1); }
+    close(fd);
+    BOARD->version = BOARD_VERSION;
+    BOARD->nslots = nworkers;
+    BOARD->pid = getpid();
+    BOARD->total = total;
+    BOARD->rate = 0;
+    BOARD->eta = BOARD->percent = -1;
+    for (i=0; i<nworkers; i++) { board_slot(BOARD, i)->fileId = -1; }
+    // readers check the magic number last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(BOARD->magic, BOARD_MAGIC, sizeof(BOARD->magic));
+}
+
+/** update the progress of all files on the --board; called between board_begin() and board_end() */
+static void board_job(struct job *j) {
+    int percent;
+    BOARD->bytes = j->bytes;
+    BOARD->total = j->total;
+    job_estimate(j, &BOARD->rate, &BOARD->eta, &percent);
+    BOARD->percent = percent;
+}
+
+/** publish a progress line parsed from a worker's scp process to the --board */
+void board_progress(struct job *j, struct worker *w, const struct scpwrap_field *fv, int percent) {
+    struct board_slot *slot = board_slot(BOARD, w->id);
+    size_t len = fv[SCPWRAP_FIELD_FILENAME].len < BOARD_NAME_SIZE ? fv[SCPWRAP_FIELD_FILENAME].len : BOARD_NAME_SIZE - 1;
+    board_begin(BOARD);
+    slot->state = BOARD_RUNNING;
+    slot->percent = percent;
+    slot->bytes = w->fileBytes;
+    slot->rate = w->fileRate;
+    slot->eta = scpwrap_parse_eta(fv[SCPWRAP_FIELD_ETA].str);
+    // the filename only changes with the file
+    if (slot->fileId != w->fileId) {
+        slot->fileId = w->fileId;
+        memcpy(slot->name, fv[SCPWRAP_FIELD_FILENAME].str, len);
+        slot->name[len] = 0;
+    }
+    board_job(j);
+    board_end(BOARD);
+}
+
+/** publish the state of a worker (BOARD_RUNNING or BOARD_EXITED) to the --board */
+void board_worker(struct job *j, struct worker *w, int state) {
+    struct board_slot *slot = board_slot(BOARD, w->id);
+    board_begin(BOARD);
+    slot->state = state;
+    slot->exitCode = w->exitCode;
+    if (state == BOARD_RUNNING) { slot->fileId = -1; slot->name[0] = 0; }
+    board_job(j);
+    board_end(BOARD);
+}
+
+/** write an unsigned LEB128 varint to the --record file */
+static void record_varint(unsigned long long n) {
+    while (n >= 0x80) { putc((int) (n & 0x7f) | 0x80, RECORD_FILE); n >>= 7; }
+    putc((int) n, RECORD_FILE);
+}
+
+/** Start recording the output of the scp processes to a file (--record), so that it
+   can be replayed later (--replay). All integers in the file are unsigned LEB128 varints,
+   and strings are a varint length followed by that many bytes.
+   The file starts with RECORD_MAGIC, then RECORD_VERSION, the number of workers, 
+   the total number of bytes to copy + 1 (or 0 if unknown), and the name of the progress
+   meter parser; then contains a record for each scp process that starts, each read() 
+   from an scp process, and each scp process that exits:
+
+     time      microseconds since the previous record (or since recording started)
+     tag       worker number * 4 + RECORD_RUN, RECORD_STDOUT, RECORD_STDERR or RECORD_EXIT
+     n         RECORD_RUN: the number of arguments the process was run with (including 
+               the command), which follow as strings;
+               RECORD_STDOUT/RECORD_STDERR: the number of bytes read, which follow;
+               RECORD_EXIT: the exit code, zigzag-encoded (as it may be -(signal number))
+
+   Version 1 recordings have no parser name, and no RECORD_RUN records.
+   exits if the file could not be created */
+void record_open(const char *filename, int nworkers, double total, const char *parser, double now) {
+    RECORD_FILE = fopen(filename, "wb");
+    if (RECORD_FILE == NULL) { perror(filename); exit(1); }
+    fputs(RECORD_MAGIC, RECORD_FILE);
+    record_varint(RECORD_VERSION);
+    record_varint(nworkers);
+    record_varint(total < 0 ? 0 : (unsigned long long) total + 1);
+    record_varint(strlen(parser));
+    fputs(parser, RECORD_FILE);
+    RECORD_START = now;
+    RECORD_USECS = 0;
+}
+
+/** write the time and tag of a record to the --record file */
+static void record_begin(int workerId, int kind, double now) {
+    double t = (now - RECORD_START) * 1e6;
+    unsigned long long usecs = t < RECORD_USECS ? RECORD_USECS : (unsigned long long) t;
+    record_varint(usecs - RECORD_USECS);
+    record_varint((unsigned long long) workerId * 4 + kind);
+    RECORD_USECS = usecs;
+}
+
+/** write a RECORD_RUN record to the --record file, for an scp process started with args */
+static void record_args(int workerId, char **args, double now) {
+    int i, n;
+    record_begin(workerId, RECORD_RUN, now);
+    for (n=0; args[n] != NULL; n++) { }
+    record_varint(n);
+    for (i=0; i<n; i++) {
+        record_varint(strlen(args[i]));
+        fputs(args[i], RECORD_FILE);
+    }
+}
+
+/** render a progress event in --delta or --binary mode, containing the file number, and the fields
+   that have changed since the last event for that file (see scpwrap-delta.h). All fields, and the
+   worker number, are included in the first event for each file, and if full is set; which it is if
+   stdout is blocked, as the event may then replace unwritten events for the file in the output queue */
+static void delta_render(struct scpwrap_outbuf *ob, struct worker *w, const struct scpwrap_field *fv, int percent, int full) {
+    static const char keys[] = "fptse";   // the placeholder for each field
+    const char *quote = DELTA_MODE == DELTA_JSON ? "\"" : "";
+    char sep = DELTA_MODE == DELTA_JSON ? ',' : '{', maskByte, percentText[24];
+    int i, mask = 0;
+
+    if (full || !w->deltaValid) { mask = DELTA_WORKER; }
+    for (i=0; i<SCPWRAP_PROGRESS_FIELDS; i++) {
+        if (full || !w->deltaValid || !field_equals(&fv[i], &w->delta.fv[i])) { mask |= 1 << i; }
+    }
+
+    if (DELTA_MODE == DELTA_BINARY) {
+        outbuf_varint(ob, w->fileId);
+        maskByte = (char) mask;
+        scpwrap_outbuf_append(ob, &maskByte, 1);
+        if (mask & DELTA_WORKER) { outbuf_varint(ob, w->id); }
+        for (i=0; i<SCPWRAP_PROGRESS_FIELDS; i++) {
+            if (!(mask & (1 << i))) { continue; }
+            if (i == SCPWRAP_FIELD_PERCENT) { outbuf_varint(ob, percent); continue; }
+            outbuf_varint(ob, fv[i].len);
+            scpwrap_outbuf_append(ob, fv[i].str, fv[i].len);
+        }
+    } else {
+        // {"i":3,"p":6,"t":"2144KB"} or sp.delta(3,{p:6,t:"2144KB"});
+        scpwrap_outbuf_append(ob, DELTA_MODE == DELTA_JSON ? "{\"i\":" : "sp.delta(", DELTA_MODE == DELTA_JSON ? 5 : 9);
+        scpwrap_outbuf_append(ob, w->fileIdText, w->fileIdLen);
+        if (DELTA_MODE == DELTA_JS) { scpwrap_outbuf_append(ob, ",", 1); }
+        for (i=-1; i<SCPWRAP_PROGRESS_FIELDS; i++) {
+            if (i == -1 ? !(mask & DELTA_WORKER) : !(mask & (1 << i))) { continue; }
+            scpwrap_outbuf_append(ob, &sep, 1);
+            scpwrap_outbuf_append(ob, quote, strlen(quote));
+            scpwrap_outbuf_append(ob, i == -1 ? "w" : &keys[i], 1);
+            scpwrap_outbuf_append(ob, quote, strlen(quote));
+            scpwrap_outbuf_append(ob, ":", 1);
+            sep = ',';
+            if (i == -1) {
+                scpwrap_outbuf_append(ob, w->idText, w->idLen);
+            } else if (i == SCPWRAP_FIELD_PERCENT) {
+                scpwrap_outbuf_append(ob, percentText, sprintf(percentText, "%d", percent));
+            } else {
+                scpwrap_outbuf_append(ob, "\"", 1);
+                scpwrap_escape_append(ob, ESCAPE_MODE, fv[i].str, fv[i].len);
+                scpwrap_outbuf_append(ob, "\"", 1);
+            }
+        }
+        if (sep == '{') { scpwrap_outbuf_append(ob, "{", 1); }
+        scpwrap_outbuf_append(ob, DELTA_MODE == DELTA_JSON ? "}\n" : "});\n", DELTA_MODE == DELTA_JSON ? 2 : 4);
+    }
+    frame_copy(&w->delta, fv, percent);
+    w->deltaValid = 1;
+}
+
+/** render a progress event from a worker, whose percent field has the value percent, 
+   preceded by the startTemplate if this is the first one */
+void emit_progress(struct emitter *em, struct worker *w, const struct scpwrap_field *fv, int percent) {
+    struct scpwrap_field all[MAX_FIELDS];
+    struct scpwrap_outbuf *ob;
+    const char *text;
+    size_t len;
+    memcpy(all, fv, SCPWRAP_PROGRESS_FIELDS * sizeof(struct scpwrap_field));
+    all[FIELD_WORKER].str = w->idText; all[FIELD_WORKER].len = w->idLen;
+    all[FIELD_FILEID].str = w->fileIdText; all[FIELD_FILEID].len = w->fileIdLen;
+    all[FIELD_HOST].str = w->host; all[FIELD_HOST].len = w->hostLen;
+    if (em->progressTpl.fieldMask & JOB_FIELD_MASK) { job_fields(&em->job, &all[FIELD_JOB_BYTES]); }
+    if (!em->shownStartTemplate) {
+        em->shownStartTemplate = 1;
+        scpwrap_template_render(outq_begin(&em->q), &em->startTpl, all);
+        text = outq_rendered(&em->q, &len);
+        sse_publish(&em->sse, SSE_START, 0, text, len);
+        outq_commit(&em->q, -1);
+    }  
+    if (DELTA_MODE == DELTA_NONE) {
+        scpwrap_template_render(outq_begin(&em->q), &em->progressTpl, all);
+        text = outq_rendered(&em->q, &len);
+        sse_publish(&em->sse, SSE_PROGRESS, w->id, text, len);
+    } else {
+        // --listen clients can connect at any time, so they're sent the complete event
+        if (em->sse.listenFd != -1) {
+            em->sseBuf.len = 0;
+            scpwrap_template_render(&em->sseBuf, &em->progressTpl, all);
+            sse_publish(&em->sse, SSE_PROGRESS, w->id, em->sseBuf.buf, em->sseBuf.len);
+        }
+        ob = outq_begin(&em->q);
+        delta_render(ob, w, fv, percent, em->q.blocked);
+    }
+    outq_commit(&em->q, w->fileId);
+}
+
+/** render a stdout/stderr event from a worker */
+void emit_text(struct emitter *em, struct worker *w, const struct scpwrap_template *t, const char *str, size_t len) {
+    struct scpwrap_field fv[MAX_FIELDS];
+    fv[0].str = str; fv[0].len = len;
+    fv[1].str = w->idText; fv[1].len = w->idLen;
+    fv[2].str = w->fileIdText; fv[2].len = w->fileIdLen;
+    fv[3].str = w->host; fv[3].len = w->hostLen;
+    scpwrap_template_render(outq_begin(&em->q), t, fv);
+    outq_commit(&em->q, -1);
+}
+
+/** render a retry event for a worker whose scp process was killed by the watchdog */
+void emit_retry(struct emitter *em, struct worker *w, double delay) {
+    struct scpwrap_field fv[MAX_FIELDS];
+    char attemptText[12], delayText[24];
+    fv[0].str = w->idText; fv[0].len = w->idLen;
+    fv[1].str = w->fileIdText; fv[1].len = w->fileIdLen;
+    fv[2].str = attemptText; fv[2].len = sprintf(attemptText, "%d", w->attempt + 1);
+    fv[3].str = w->killReason; fv[3].len = strlen(w->killReason);
+    fv[4].str = delayText; fv[4].len = sprintf(delayText, "%g", delay);
+    fv[5].str = w->host; fv[5].len = w->hostLen;
+    scpwrap_template_render(outq_begin(&em->q), &em->retryTpl, fv);
+    outq_commit(&em->q, -1);
+}
+
+/** emit the pending progress event for a worker's current file, if there is one */
+static void worker_flush(struct emitter *em, struct worker *w, double now, int endOfFile) {
+    struct scpwrap_field *pendingFv = coalesce_flush(&w->co, now, endOfFile);
+    if (pendingFv != NULL) { emit_progress(em, w, pendingFv, w->co.last.percent); }
+}
+
+/** set the arguments of a worker to run a copy operation in --parallel or --batch mode: the
+   first base arguments (the command and scp options) are already set, and are followed by 
+   the options to use the control connection to the destination host (if it's running), 
+   then the source and destination */
+void worker_op(struct worker *w, struct copy_op *op, int base) {
+    char **arg = w->args + base;
+    if (op->master != -1 && MASTERS[op->master].running) {
+        *arg++ = "-o"; *arg++ = MASTERS[op->master].pathOption;
+        *arg++ = "-o"; *arg++ = "ControlMaster=no";
+    }
+    *arg++ = op->source;
+    *arg++ = op->dest;
+    *arg = NULL;
+    w->host = op->host;
+    w->hostLen = strlen(op->host);
+}
+
+/** start an scp process for a worker using w->args, and register its stdout/stderr 
+   with the epoll instance.
+   returns 0 on success, or -1 if the process couldn't be started */
+int worker_start(struct worker *w, int epfd) {
+    struct epoll_event ev;
+
+    w->pid = scpwrap_spawn(w->args, &w->stdoutPtyFd, &w->stderrPipeFd);
+    if (w->pid == -1) { w->pid = 0; return -1; }
+    w->attemptBytes = w->checkBytes = 0;
+    w->checkTime = now_secs();
+    w->killTime = w->retryTime = 0;
+    w->killReason = NULL;
+    scpwrap_stream_start(&w->stream, w->args);
+    if (RECORD_FILE != NULL) { record_args(w->id, w->args, w->checkTime); }
+
+    /* Watch stdout (stdoutPtyFd) or stderr (stderrPipeFd) to see when it has input. */
+    ev.events = EPOLLIN;
+    ev.data.u32 = w->id * 2;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, w->stdoutPtyFd, &ev);
+    ev.data.u32 = w->id * 2 + 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, w->stderrPipeFd, &ev);
+    return 0;
+}
+
+/** process a progress line from a worker's scp process */
+static void worker_progress(struct emitter *em, struct worker *w, const struct scpwrap_progress *p, double now) {
+    const struct scpwrap_field *fv = p->fv;
+    int percent = field_percent(fv);
+    // emit the last event for the previous file before starting a new one
+    if (!coalesce_same_file(&w->co, fv)) {
+        worker_flush(em, w, now, 1);
+        w->fileId = em->fileCount++;
+        w->fileIdLen = sprintf(w->fileIdText, "%d", w->fileId);
+        w->fileBytes = 0;
+        w->deltaValid = 0;
+    }
+    STATS.progressLines++;
+    job_file_progress(&em->job, w, p->bytes, p->rate, now);
+    if (BOARD != NULL) { board_progress(&em->job, w, fv, percent); }
+    if (coalesce_accept(&w->co, fv, percent, now)) {
+        emit_progress(em, w, fv, percent);
+    }
+}
+
+/** called by a worker's stream with the event for each line of its scp process's output */
+static void worker_event(void *ctx, const struct scpwrap_event *ev) {
+    struct worker *w = ctx;
+    struct emitter *em = w->em;
+    if (ev->type == SCPWRAP_EVENT_PROGRESS) {
+        worker_progress(em, w, ev->progress, em->now);
+        return;
+    }
+    // anything else in the progress meter output ends the current file
+    if (ev->endsFile) { worker_flush(em, w, em->now, 1); }
+    if (ev->type == SCPWRAP_EVENT_TEXT) {
+        if (ev->isStderr) { STATS.stderrEvents++; } else { STATS.stdoutEvents++; }
+        emit_text(em, w, ev->isStderr ? &em->stderrTpl : &em->stdoutTpl, ev->text, ev->len);
+    }
+}
+
+/** read a worker's stdout (if isStderr is 0) or stderr (if isStderr is 1), and emit events for any complete lines.
+   returns 1 if both stdout and stderr have now been closed */
+int worker_read(struct emitter *em, struct worker *w, int isStderr, double now) {
+    struct scpwrap_stream *s = &w->stream;
+    size_t avail;
+    char *buf;
+    ssize_t n;
+    if (!s->framers[isStderr].eof) {
+        em->now = now;
+        // read straight into the stream's buffer, so that it can be recorded as well
+        buf = scpwrap_stream_space(s, isStderr, &avail);
+        n = read(isStderr ? w->stderrPipeFd : w->stdoutPtyFd, buf, avail);
+        STATS.reads++;
+        if (n > 0) {
+            *(isStderr ? &STATS.stderrBytes : &STATS.stdoutBytes) += n;
+            if (RECORD_FILE != NULL) {
+                record_begin(w->id, isStderr ? RECORD_STDERR : RECORD_STDOUT, now);
+                record_varint(n);
+                fwrite(buf, 1, n, RECORD_FILE);
+            }
+            scpwrap_stream_push(s, isStderr, n);
+        } else if (!(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+            // NB: reading the master side of a pty returns EIO once the child has gone
+            scpwrap_stream_close(s, isStderr);
+        }
+    }
+    return scpwrap_stream_closed(s);
+}
+
+/** wait for a worker's scp process to exit once its stdout & stderr have been closed,
+   and record its exit status. If the worker has no process (in --replay mode), then
+   w->exitCode should already be set */
+void worker_finish(struct emitter *em, struct worker *w, double now) {
+    int exitStatus = 0;               // scp child process exit status
+    
+    // any unterminated text will have been emitted as a final line when the stream was closed
+    worker_flush(em, w, now, 1);
+    job_file_progress(&em->job, w, w->fileBytes, 0, now);
+    w->fileBytes = 0;
+    if (w->pid == 0) {
+        // replayed; w->exitCode has been read from the recording
+        if (BOARD != NULL) { board_worker(&em->job, w, BOARD_EXITED); }
+        return;
+    }
+    close(w->stdoutPtyFd);            // closing the fds also removes them from the epoll instance
+    close(w->stderrPipeFd);
+    
+    // get the exit status of the scp process. 
+    if (waitpid (w->pid, &exitStatus, 0) == -1) { perror("waitpid"); exit(1); }
+    w->pid = 0;
+    if (WIFEXITED(exitStatus)) {
+        w->exitCode = WEXITSTATUS(exitStatus);
+    } else if (WIFSIGNALED(exitStatus)) {
+        // display a signal as -(signal number)
+        w->exitCode = -WTERMSIG(exitStatus);
+    }
+    if (RECORD_FILE != NULL) {
+        record_begin(w->id, RECORD_EXIT, now);
+        record_varint(w->exitCode < 0 ? (unsigned long long) -w->exitCode * 2 - 1 : (unsigned long long) w->exitCode * 2);
+    }
+    if (BOARD != NULL) { board_worker(&em->job, w, BOARD_EXITED); }
+}
+
+/** Stall watchdog (--stall-timeout and --min-speed).
+
+   The bytes copied by each scp process are measured over a window of WATCHDOG.window
+   seconds; if it hasn't copied anything, or has copied less than WATCHDOG.minSpeed 
+   bytes per second, it's sent SIGTERM (and SIGKILL if it's still running 
+   WATCHDOG_KILL_GRACE seconds later). When it exits, worker_retry() schedules
+   another attempt, with exponential backoff; watchdog_check() starts it.
+
+   returns the number of seconds until watchdog_check() should next be called for the
+   worker, or -1 if it doesn't need to be */
+double watchdog_timeout(struct worker *w, double now) {
+    double t;
+    if (w->pid == 0) {
+        t = w->retryTime;
+    } else if (w->killTime < 0) {
+        return -1;  // waiting for SIGKILL to take effect
+    } else if (w->killTime > 0) {
+        t = w->killTime + WATCHDOG_KILL_GRACE;
+    } else if (WATCHDOG.window > 0) {
+        t = w->checkTime + WATCHDOG.window;
+    } else {
+        return -1;
+    }
+    if (t == 0) { return -1; }
+    return t < now ? 0 : t - now;
+}
+
+/** kill a worker's scp process if it has stalled, or start the next attempt of one that 
+   was killed. returns 1 if an scp process was started, -1 if it couldn't be started, otherwise 0 */
+int watchdog_check(struct emitter *em, struct worker *w, int epfd, double now) {
+    double speed;
+    if (w->pid == 0) {
+        if (w->retryTime == 0 || now < w->retryTime) { return 0; }
+        w->retryTime = 0;
+        if (worker_start(w, epfd) == -1) { w->exitCode = WATCHDOG_EXIT; return -1; }
+        if (BOARD != NULL) { board_worker(&em->job, w, BOARD_RUNNING); }
+        return 1;
+    }
+    if (w->killTime > 0) {
+        // SIGTERM should have been enough; scp passes it on to ssh
+        if (now >= w->killTime + WATCHDOG_KILL_GRACE) { kill(w->pid, SIGKILL); w->killTime = -1; }
+        return 0;
+    }
+    if (WATCHDOG.window == 0 || w->killTime < 0 || now < w->checkTime + WATCHDOG.window) { return 0; }
+    speed = (w->attemptBytes - w->checkBytes) / (now - w->checkTime);
+    if (w->attemptBytes <= w->checkBytes) {
+        w->killReason = "stalled";
+    } else if (speed < WATCHDOG.minSpeed) {
+        w->killReason = "slow";
+    } else {
+        w->checkTime = now;
+        w->checkBytes = w->attemptBytes;
+        return 0;
+    }
+    kill(w->pid, SIGTERM);
+    w->killTime = now;
+    return 0;
+}
+
+/** called when a worker's scp process has finished; if it was killed by the watchdog 
+   and has retries left, then schedule another attempt.
+   returns 1 if another attempt will be made, otherwise 0 */
+int worker_retry(struct emitter *em, struct worker *w, double now) {
+    double delay;
+    // it may have finished successfully before it received the signal
+    if (w->killReason == NULL || w->exitCode == 0) { return 0; }
+    if (w->attempt > WATCHDOG.retries) {
+        w->exitCode = WATCHDOG_EXIT;
+        if (BOARD != NULL) { board_worker(&em->job, w, BOARD_EXITED); }
+        return 0;
+    }
+    // the next attempt will copy everything again
+    em->job.bytes -= w->attemptBytes;
+    em->job.textValid = 0;
+    w->attemptBytes = 0;
+    delay = WATCHDOG.retryDelay * pow(2, w->attempt - 1);
+    emit_retry(em, w, delay);
+    w->attempt++;
+    w->retryTime = now + delay;
+    return 1;
+}
+
+/** start the next of the nops copy operations in ops (from *nextOp) on a worker whose last
+   copy operation has finished, in --parallel or --batch mode. base is the number of 
+   arguments before each operation's (see worker_op()). Operations that can't be started 
+   have failed; they are counted as finished copies, and *exitCode is set to 1 if it's 0.
+   returns 1 if an operation was started, or 0 if there were none left to start */
+int worker_next(struct emitter *em, struct worker *w, struct copy_op *ops, int nops, int *nextOp, 
+    int base, int epfd, int *exitCode) 
+{
+    while (*nextOp < nops) {
+        worker_op(w, &ops[(*nextOp)++], base);
+        w->attempt = 1;
+        if (worker_start(w, epfd) == 0) { 
+            if (BOARD != NULL) { board_worker(&em->job, w, BOARD_RUNNING); }
+            return 1;
+        }
+        em->job.copiesFinished++;
+        em->job.textValid = 0;
+        if (*exitCode == 0) { *exitCode = 1; }
+    }
+    return 0;
+}
+
+/** return the number of microseconds within which the fraction p of the events in 
+   the --stats latency histogram were written (rounded up to a power of 2), or 0 if there 
+   weren't any events */
+static unsigned long long stats_percentile(double p) {
+    unsigned long long n = 0, total = 0;
+    int i;
+    for (i=0; i<=STATS_BUCKETS; i++) { total += STATS.latency[i]; }
+    for (i=0; i<=STATS_BUCKETS && total > 0; i++) {
+        n += STATS.latency[i];
+        if (n >= p * total) { return 1ULL << i; }
+    }
+    return 0;
+}
+
+/** write the --stats report to stderr. final is set to 1 for the report at exit, 
+   and 0 for reports every --stats-interval seconds */
+void stats_report(struct emitter *em, struct worker *workers, int nworkers, int final, double now) {
+    unsigned long long emitted = 0, received = 0, events = 0, lines = 0;
+    unsigned long long heapBytes = ARENA.heapBytes, heapCalls = ARENA.heapCalls;
+    int i;
+    for (i=0; i<nworkers; i++) { 
+        received += workers[i].co.received; 
+        emitted += workers[i].co.emitted;
+        lines += workers[i].stream.lines;
+        heapBytes += workers[i].arena.heapBytes;
+        heapCalls += workers[i].arena.heapCalls;
+    }
+    emitted -= em->q.replaced;
+    for (i=0; i<=STATS_BUCKETS; i++) { events += STATS.latency[i]; }
+    if (STATS_INTERVAL > 0) { STATS.nextReport = now + STATS_INTERVAL; }
+
+    if (STATS_FORMAT == STATS_JSON) {
+        fprintf(stderr, "{\"event\":\"stats\",\"final\":%s,\"elapsed\":%.3f,"
+            "\"reads\":%llu,\"writes\":%llu,\"polls\":%llu,"
+            "\"stdoutBytes\":%llu,\"stderrBytes\":%llu,\"lines\":%llu,"
+            "\"progressLines\":%llu,\"stdoutEvents\":%llu,\"stderrEvents\":%llu,"
+            "\"progressEmitted\":%llu,\"progressSuppressed\":%llu,\"outputBytes\":%llu,"
+            "\"pollTime\":%.6f,\"writeTime\":%.6f,\"heapBytes\":%llu,\"heapCalls\":%llu,"
+            "\"latency\":{\"events\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu,\"histogram\":[",
+            final ? "true" : "false", now - STATS.startTime,
+            STATS.reads, STATS.writes, STATS.polls, 
+            STATS.stdoutBytes, STATS.stderrBytes, lines,
+            STATS.progressLines, STATS.stdoutEvents, STATS.stderrEvents,
+            emitted, received - emitted, STATS.outputBytes, 
+            STATS.pollTime, STATS.writeTime, heapBytes, heapCalls,
+            events, stats_percentile(0.5), stats_percentile(0.9), stats_percentile(0.99), stats_percentile(1));
+        for (i=0; i<=STATS_BUCKETS; i++) { fprintf(stderr, "%s%llu", i == 0 ? "" : ",", STATS.latency[i]); }
+        fprintf(stderr, "]}}\n");
+    } else {
+        fprintf(stderr, "scpwrap stats (%s, %.3fs):\n"
+            "  syscalls: %llu reads, %llu writes, %llu polls\n"
+            "  input:    %llu stdout bytes, %llu stderr bytes, %llu lines\n"
+            "  lines:    %llu progress, %llu stdout, %llu stderr\n"
+            "  output:   %llu progress events emitted, %llu suppressed, %llu bytes\n"
+            "  blocked:  %.6fs polling, %.6fs writing\n"
+            "  memory:   %llu bytes in %llu allocations\n"
+            "  latency:  %llu events; p50 <%lluus, p90 <%lluus, p99 <%lluus, max <%lluus\n",
+            final ? "final" : "interim", now - STATS.startTime,
+            STATS.reads, STATS.writes, STATS.polls, 
+            STATS.stdoutBytes, STATS.stderrBytes, lines,
+            STATS.progressLines, STATS.stdoutEvents, STATS.stderrEvents,
+            emitted, received - emitted, STATS.outputBytes, 
+            STATS.pollTime, STATS.writeTime, heapBytes, heapCalls,
+            events, stats_percentile(0.5), stats_percentile(0.9), stats_percentile(0.99), stats_percentile(1));
+    }
+}
+
+/** read an unsigned LEB128 varint from a --replay file.
+   returns 0 on success, or -1 at the end of the file */
+static int replay_varint(FILE *f, unsigned long long *n) {
+    int c, shift = 0;
+    *n = 0;
+    do {
+        if ((c = getc(f)) == EOF || shift > 63) { return -1; }
+        *n |= (unsigned long long) (c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+/** open a file created by --record, and read the number of workers, the total
+   number of bytes to copy (or -1 if unknown), and the name of the parser (or "" if 
+   it isn't recorded) from its header. parser must have room for parserSize bytes.
+   returns the file, or NULL if it could not be read */
+FILE *replay_open(const char *filename, int *nworkers, double *total, char *parser, size_t parserSize) {
+    FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+    char magic[sizeof(RECORD_MAGIC) - 1];
+    unsigned long long version, n, t, len = 0;
+    if (f == NULL) { perror(filename); return NULL; }
+    if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0 ||
+        replay_varint(f, &version) == -1 || replay_varint(f, &n) == -1 || replay_varint(f, &t) == -1 ||
+        n == 0 || n > 65536) {
+        fprintf(stderr, "%s is not an scpwrap recording\n", filename);
+        return NULL;
+    }
+    if (version < 1 || version > RECORD_VERSION) {
+        fprintf(stderr, "%s is a version %llu recording; only versions 1 to %d are supported\n", filename, version, RECORD_VERSION);
+        return NULL;
+    }
+    if (version >= 2 && (replay_varint(f, &len) == -1 || len >= parserSize || fread(parser, 1, len, f) != len)) {
+        fprintf(stderr, "%s is not an scpwrap recording\n", filename);
+        return NULL;
+    }
+    parser[len] = 0;
+    *nworkers = (int) n;
+    *total = (double) t - 1;
+    return f;
+}
+
+/** write queued output, and serve --listen clients, while waiting until the time due (from now_secs()) */
+static void replay_wait(struct emitter *em, double due) {
+    struct outq *q = &em->q;
+    fd_set readFds, writeFds;
+    struct timeval tv;
+    double t;
+    int nfds, n;
+    if (outq_full(q)) { outq_drain(q, OUTQ_MAXSIZE / 2); }
+    sse_flush(&em->sse);
+    while ((t = due - now_secs()) > 0) {
+        FD_ZERO(&readFds);
+        FD_ZERO(&writeFds);
+        nfds = 0;
+        if (outq_pending(q)) { FD_SET(q->fd, &writeFds); nfds = q->fd + 1; }
+        if (em->sse.listenFd != -1) { 
+            FD_SET(em->sse.epfd, &readFds); 
+            if (em->sse.epfd >= nfds) { nfds = em->sse.epfd + 1; }
+        }
+        tv.tv_sec = (time_t) t;
+        tv.tv_usec = (suseconds_t) ((t - tv.tv_sec) * 1e6);
+        STATS.polls++;
+        n = select(nfds, &readFds, &writeFds, NULL, &tv);
+        if (STATS_FORMAT != STATS_NONE) { STATS.pollTime += now_secs() - (due - t); }
+        if (n > 0) { 
+            if (FD_ISSET(q->fd, &writeFds)) { outq_write(q); }
+            if (em->sse.listenFd != -1 && FD_ISSET(em->sse.epfd, &readFds)) { sse_service(&em->sse); }
+            sse_flush(&em->sse);
+        }
+    }
+    if (outq_pending(q)) { outq_write(q); }
+}
+
+/** emit the events for any lines left in a replayed worker's stream, and finish it */
+static void replay_finish(struct emitter *em, struct worker *w, double now) {
+    em->now = now;
+    scpwrap_stream_close(&w->stream, 0);
+    scpwrap_stream_close(&w->stream, 1);
+    worker_finish(em, w, now);
+    em->job.copiesFinished++;
+    em->job.textValid = 0;
+}
+
+/** Feed a recording made with --record through the same framing, parsing and templating 
+   as the output of live scp processes. Times are taken from the recording, so that
+   --max-rate coalescing and throughput are the same on every replay. If speed is 
+   greater than 0, the recording is replayed that many times faster than it was 
+   recorded, otherwise it's replayed as quickly as possible.
+   returns the exit code of the first recorded scp process that failed, or 0 */
+int replay_run(struct emitter *em, struct worker *workers, int nworkers, FILE *f, double speed) {
+    unsigned long long usecs = 0, delta, tag, n;
+    double now = 0, start = now_secs();
+    int exitCode = 0, corrupt = 0, isStderr, c, i;
+    struct worker *w;
+    size_t len;
+    char *buf;
+    struct scpwrap_outbuf argText;    // arguments of a RECORD_RUN record, each NUL-terminated
+    char **args = NULL;
+    unsigned long long argsSize = 0;
+
+    if (scpwrap_outbuf_init(&argText, NULL, 256) == -1) { perror("malloc"); exit(1); }
+
+    while ((c = getc(f)) != EOF) {
+        ungetc(c, f);
+        if (replay_varint(f, &delta) == -1 || replay_varint(f, &tag) == -1 || replay_varint(f, &n) == -1 || 
+            tag / 4 >= (unsigned) nworkers || tag % 4 > RECORD_RUN) { corrupt = 1; break; }
+        usecs += delta;
+        now = usecs / 1e6;
+        // emit any held-back progress events that became due before this record
+        for (i=0; i<nworkers; i++) {
+            if (coalesce_timeout(&workers[i].co, now) == 0) { worker_flush(em, &workers[i], now, 0); }
+        }
+        replay_wait(em, speed > 0 ? start + now / speed : 0);
+        if (STATS_FORMAT != STATS_NONE) {
+            em->q.inputTime = now_secs();
+            if (STATS.nextReport > 0 && em->q.inputTime >= STATS.nextReport) { 
+                stats_report(em, workers, nworkers, 0, em->q.inputTime); 
+            }
+        }
+
+        w = &workers[tag / 4];
+        if (tag % 4 == RECORD_EXIT) {
+            w->exitCode = n & 1 ? -(int) (n / 2) - 1 : (int) (n / 2);
+            replay_finish(em, w, now);
+            if (w->exitCode != 0 && exitCode == 0) { exitCode = w->exitCode; }
+            continue;
+        }
+        if (tag % 4 == RECORD_RUN) {
+            if (n > 65536) { corrupt = 1; break; }
+            if (n + 1 > argsSize) {
+                args = realloc(args, (n + 1) * sizeof(char *));
+                if (args == NULL) { perror("realloc"); exit(1); }
+                argsSize = n + 1;
+            }
+            argText.len = 0;
+            for (i=0; i<(int) n; i++) {
+                if (replay_varint(f, &delta) == -1 || delta > SCPWRAP_LINE_MAXSIZE) { break; }
+                scpwrap_outbuf_reserve(&argText, delta + 1);
+                if (fread(argText.buf + argText.len, 1, delta, f) != delta) { break; }
+                argText.len += delta;
+                argText.buf[argText.len++] = 0;
+            }
+            if (i < (int) n) { corrupt = 1; break; }
+            for (i=0, len=0; i<(int) n; i++) { args[i] = argText.buf + len; len += strlen(args[i]) + 1; }
+            args[n] = NULL;
+            scpwrap_stream_start(&w->stream, args);
+            if (BOARD != NULL) { board_worker(&em->job, w, BOARD_RUNNING); }
+            continue;
+        }
+        // in version 1 recordings, a worker that has finished starts its next scp process
+        // when there's output from it
+        if (scpwrap_stream_closed(&w->stream)) {
+            scpwrap_stream_start(&w->stream, NULL);
+            if (BOARD != NULL) { board_worker(&em->job, w, BOARD_RUNNING); }
+        }
+        isStderr = tag % 4 == RECORD_STDERR;
+        *(isStderr ? &STATS.stderrBytes : &STATS.stdoutBytes) += n;
+        em->now = now;
+        while (n > 0) {
+            // fewer bytes are read if there's no room for them until the current line has been parsed
+            buf = scpwrap_stream_space(&w->stream, isStderr, &len);
+            if (len > n) { len = n; }
+            if (fread(buf, 1, len, f) != len) { break; }
+            n -= len;
+            scpwrap_stream_push(&w->stream, isStderr, len);
+        }
+        if (n > 0) { corrupt = 1; break; }
+    }
+    free(args);
+    scpwrap_outbuf_free(&argText);
+    if (corrupt || ferror(f)) {
+        fprintf(stderr, "recording is truncated or corrupt\n");
+        if (exitCode == 0) { exitCode = 1; }
+    }
+    // finish any workers that were still running when recording stopped
+    for (i=0; i<nworkers; i++) {
+        if (!scpwrap_stream_closed(&workers[i].stream)) { replay_finish(em, &workers[i], now); }
+    }
+    return exitCode;
+}
+
+/** Split the scp command-line arguments into options (and their arguments) and operands
+   (the source and destination files). opts and operands must have room for argc entries. */
+void split_scp_args(int argc, char **argv, char **opts, int *nopts, char **operands, int *noperands) {
+    int i;
+    *nopts = *noperands = 0;
+    for (i=0; i<argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            for (i++; i<argc; i++) { operands[(*noperands)++] = argv[i]; }
+        } else if (argv[i][0] == '-' && argv[i][1] != 0) {
+            opts[(*nopts)++] = argv[i];
+            // options that take an argument, if it's not in the same argv element
+            if (argv[i][2] == 0 && strchr(SCP_ARG_OPTIONS, argv[i][1]) != NULL && i+1 < argc) {
+                opts[(*nopts)++] = argv[++i];
+            }
+        } else {
+            operands[(*noperands)++] = argv[i];
+        }
+    }
+}
+
+/** append the sources listed in a manifest file (one per line) to the sources list.
+   returns 0 on success, or -1 if the file could not be read */
+int read_manifest(const char *filename, char ***sources, int *nsources, int *size) {
+    FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t len;
+    if (f == NULL) { perror(filename); return -1; }
+    while ((len = getline(&line, &lineSize, f)) != -1) {
+        while (len > 0 && (line[len-1]=='\n' || line[len-1]=='\r')) { line[--len] = 0; }
+        if (len == 0) { continue; }
+        if (*nsources == *size) {
+            *size = *size * 2 + 16;
+            *sources = realloc(*sources, *size * sizeof(char *));
+            if (*sources == NULL) { perror("realloc"); exit(1); }
+        }
+        (*sources)[(*nsources)++] = strdup(line);
+    }
+    free(line);
+    if (f != stdin) { fclose(f); }
+    return 0;
+}
+
+/** return the length of the [user@]host part of an scp destination (e.g. "user@host:dir/"),
+   or 0 if it's a local path. As in scp, the host is separated from the path by the first
+   colon, if there's no '/' before it; IPv6 addresses are in brackets. scp:// URIs aren't
+   recognised, so in --batch mode they're copied without a control connection */
+size_t dest_host(const char *dest) {
+    size_t i;
+    if (strncmp(dest, "scp://", 6) == 0) { return 0; }
+    for (i=0; dest[i] != 0 && dest[i] != '/'; i++) {
+        if (dest[i] == '[') {
+            while (dest[i] != 0 && dest[i] != ']') { i++; }
+            if (dest[i] == 0) { return 0; }
+        } else if (dest[i] == ':') {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/** return a copy of the [user@]host part of an scp destination, or "" if it's a local path */
+char *host_name(const char *dest) {
+    char *host = strndup(dest, dest_host(dest));
+    if (host == NULL) { perror("strndup"); exit(1); }
+    return host;
+}
+
+/** return the index in MASTERS of the control connection for the host of a destination
+   (adding one if there isn't one yet), or -1 if it's a local path. *host is set to the 
+   host, or "" */
+static int batch_master(const char *dest, const char **host) {
+    size_t len = dest_host(dest);
+    int i;
+    *host = "";
+    if (len == 0) { return -1; }
+    for (i=0; i<NMASTERS; i++) {
+        if (strlen(MASTERS[i].host) == len && memcmp(MASTERS[i].host, dest, len) == 0) { 
+            *host = MASTERS[i].host;
+            return i; 
+        }
+    }
+    MASTERS = realloc(MASTERS, (NMASTERS + 1) * sizeof(struct ssh_master));
+    if (MASTERS == NULL) { perror("realloc"); exit(1); }
+    memset(&MASTERS[NMASTERS], 0, sizeof(struct ssh_master));
+    MASTERS[NMASTERS].host = host_name(dest);
+    MASTERS[NMASTERS].target = strdup(MASTERS[NMASTERS].host);
+    if (MASTERS[NMASTERS].target == NULL) { perror("strdup"); exit(1); }
+    for (i=0, len=0; MASTERS[NMASTERS].host[i] != 0; i++) {
+        if (strchr("[]", MASTERS[NMASTERS].host[i]) == NULL) { MASTERS[NMASTERS].target[len++] = MASTERS[NMASTERS].host[i]; }
+    }
+    MASTERS[NMASTERS].target[len] = 0;
+    *host = MASTERS[NMASTERS].host;
+    return NMASTERS++;
+}
+
+/** read the copy operations in a --batch file, which contains a source and destination on
+   each line, separated by a tab (or if there isn't one, the last space); e.g.
+   "dir/file.txt user@host:dir/". Operations are grouped by destination host (in the 
+   order each host first appears, after any local copies), so that each group runs 
+   together over its host's control connection.
+   returns 0 on success, or -1 if the file could not be read */
+int read_batch(const char *filename, struct copy_op **ops, int *nops) {
+    FILE *f = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+    char *line = NULL, *sep, *end;
+    size_t lineSize = 0;
+    ssize_t len;
+    int size = 0, lineNumber = 0;
+    struct copy_op *op, *grouped;
+    int *start, i;
+    if (f == NULL) { perror(filename); return -1; }
+    while ((len = getline(&line, &lineSize, f)) != -1) {
+        lineNumber++;
+        while (len > 0 && (line[len-1]=='\n' || line[len-1]=='\r')) { line[--len] = 0; }
+        if (len == 0) { continue; }
+        if ((sep = strchr(line, '\t')) == NULL) { sep = strrchr(line, ' '); }
+        for (end = sep; end != NULL && end > line && (end[-1]==' ' || end[-1]=='\t'); end--) { }
+        if (sep == NULL || end == line || sep[1] == 0) {
+            fprintf(stderr, "%s:%d: expected a source and a destination\n", filename, lineNumber);
+            return -1;
+        }
+        *end = 0;
+        if (*nops == size) {
+            size = size * 2 + 16;
+            *ops = realloc(*ops, size * sizeof(struct copy_op));
+            if (*ops == NULL) { perror("realloc"); exit(1); }
+        }
+        op = &(*ops)[(*nops)++];
+        op->source = strdup(line);
+        op->dest = strdup(sep + 1);
+        if (op->source == NULL || op->dest == NULL) { perror("strdup"); exit(1); }
+        op->master = batch_master(op->dest, &op->host);
+    }
+    free(line);
+    if (f != stdin) { fclose(f); }
+
+    // stable counting sort by master index; local copies (-1) first
+    start = calloc(NMASTERS + 2, sizeof(int));
+    grouped = malloc((*nops + 1) * sizeof(struct copy_op));
+    if (start == NULL || grouped == NULL) { perror("malloc"); exit(1); }
+    for (i=0; i<*nops; i++) { start[(*ops)[i].master + 2]++; }
+    for (i=1; i<NMASTERS + 2; i++) { start[i] += start[i-1]; }
+    for (i=0; i<*nops; i++) { grouped[start[(*ops)[i].master + 1]++] = (*ops)[i]; }
+    free(*ops);
+    free(start);
+    *ops = grouped;
+    return 0;
+}
+
+/** copy the scp options that also apply to ssh (-4, -6, -C, -c, -F, -i, -J, -o, and -P, 
+   which is -p in ssh) into sshOpts, which must have room for nopts entries.
+   returns the number of entries copied */
+static int ssh_options(char **opts, int nopts, char **sshOpts) {
+    int i, n = 0, separate;
+    char *o;
+    for (i=0; i<nopts; i++) {
+        o = opts[i];
+        if (o[0] != '-' || o[1] == 0) { continue; }
+        if (strchr(SCP_ARG_OPTIONS, o[1]) != NULL) {
+            // the option's argument is the next entry, if it's not in this one (as per split_scp_args())
+            separate = o[2] == 0 && i+1 < nopts;
+            if (strchr("cFiJoP", o[1]) != NULL) {
+                if (o[1] == 'P') {
+                    if ((o = strdup(o)) == NULL) { perror("strdup"); exit(1); }
+                    o[1] = 'p';
+                }
+                sshOpts[n++] = o;
+                if (separate) { sshOpts[n++] = opts[i+1]; }
+            }
+            i += separate;
+        } else if (o[2] == 0 && strchr("46C", o[1]) != NULL) {
+            sshOpts[n++] = o;
+        }
+    }
+    return n;
+}
+
+/** run an ssh command for a control connection, with stdin, stdout and stderr redirected 
+   to /dev/null, so that the connection (which "ssh -f" leaves running in the background) 
+   doesn't hold scpwrap's stdout open. Passwords and host keys are still prompted for on 
+   the terminal.
+   returns the pid of the ssh process, or -1 if it couldn't be started */
+static pid_t ssh_spawn(char **args) {
+    pid_t pid = fork();
+    int fd;
+    if (pid == 0) {
+        /* CHILD */
+        if ((fd = open("/dev/null", O_RDWR)) != -1) { dup2(fd, 0); dup2(fd, 1); dup2(fd, 2); }
+        execvp(args[0], args);
+        _exit(2);
+    } else if (pid == -1) {
+        perror("fork");
+    }
+    return pid;
+}
+
+/** close the SSH control connections (with "ssh -O exit"), and remove their directory;
+   called at exit, so that the connections last as long as the batch */
+void masters_close() {
+    char *args[7];
+    int i, status;
+    pid_t pid;
+    for (i=0; i<NMASTERS; i++) {
+        if (!MASTERS[i].running) { continue; }
+        args[0] = SSH_COMMAND; args[1] = "-o"; args[2] = MASTERS[i].pathOption;
+        args[3] = "-O"; args[4] = "exit"; args[5] = MASTERS[i].target; args[6] = NULL;
+        if ((pid = ssh_spawn(args)) > 0) { waitpid(pid, &status, 0); }
+        MASTERS[i].running = 0;
+        // the socket is normally removed by ssh, but may not have been yet
+        unlink(MASTERS[i].pathOption + strlen("ControlPath="));
+    }
+    if (MASTER_DIR != NULL) { rmdir(MASTER_DIR); MASTER_DIR = NULL; }
+}
+
+/** open an SSH control connection to each host in MASTERS, using the ssh options among
+   the scp options (e.g. -i and -o), and wait for them to authenticate. The connections
+   are all started at once, so that their handshakes overlap; any that fail are left
+   closed, and the scp processes for that host connect by themselves as usual.
+   The connections are closed by masters_close() when scpwrap exits */
+void masters_open(char **opts, int nopts) {
+    char **args = malloc((nopts + 14) * sizeof(char *));
+    char timeoutOption[32];
+    int i, n, nargs, status;
+    if (args == NULL) { perror("malloc"); exit(1); }
+    if (NMASTERS == 0) { free(args); return; }
+    // control socket paths are limited to about 100 characters, so this doesn't use $TMPDIR
+    MASTER_DIR = strdup("/tmp/scpwrap-XXXXXX");
+    if (MASTER_DIR == NULL || mkdtemp(MASTER_DIR) == NULL) { perror("mkdtemp"); exit(1); }
+    atexit(masters_close);
+
+    args[0] = SSH_COMMAND;
+    nargs = ssh_options(opts, nopts, args + 1) + 1;
+    // so that an unreachable host doesn't hold up the copies to every other host; ssh uses the 
+    // first value it's given, so a ConnectTimeout in the scp options takes precedence
+    if (SSH_CONNECT_TIMEOUT > 0) {
+        sprintf(timeoutOption, "ConnectTimeout=%d", SSH_CONNECT_TIMEOUT);
+        args[nargs++] = "-o"; args[nargs++] = timeoutOption;
+    }
+    for (i=0; i<NMASTERS; i++) {
+        MASTERS[i].pathOption = malloc(strlen(MASTER_DIR) + 32);
+        if (MASTERS[i].pathOption == NULL) { perror("malloc"); exit(1); }
+        sprintf(MASTERS[i].pathOption, "ControlPath=%s/%d", MASTER_DIR, i);
+        n = nargs;
+        args[n++] = "-o"; args[n++] = "ControlMaster=yes";
+        args[n++] = "-o"; args[n++] = MASTERS[i].pathOption;
+        args[n++] = "-o"; args[n++] = "ControlPersist=" MASTER_PERSIST;
+        args[n++] = "-N"; args[n++] = "-f";
+        args[n++] = MASTERS[i].target;
+        args[n] = NULL;
+        MASTERS[i].pid = ssh_spawn(args);
+    }
+    // "ssh -f" exits once it has authenticated, leaving the connection running in the background
+    for (i=0; i<NMASTERS; i++) {
+        if (MASTERS[i].pid > 0 && waitpid(MASTERS[i].pid, &status, 0) != -1 && 
+            WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            MASTERS[i].running = 1;
+        } else {
+            fprintf(stderr, "Couldn't open an SSH control connection to %s; copying to it without one\n", MASTERS[i].host);
+        }
+        MASTERS[i].pid = 0;
+    }
+    free(args);
+}
+
+/** send usage information to stdout */ 
+void usage() {
+    printf("usage: scpwrap [options] -- scp-options \n"
+      "       scpwrap [options] --batch file [-- scp-options]\n"
+      "       scpwrap [options] --replay file\n"
+      "Where options are:\n" 
+      "  --js                   use javascript default templates, and javascript-escape output strings\n"
+      "  --json                 use JSON default templates, and JSON-escape output strings\n"
+      "  --stdoutTemplate txt   template to use for unrecognised stdout text\n"
+      "  --stderrTemplate txt   template to use for unrecognised stderr text\n"
+      "  --startTemplate txt    text to display before the first progressTemplate appears\n"
+      "  --progressTemplate txt template to use for copy progress output\n"
+      "  --endTemplate txt      template to use after copy completes\n"
+      "  --delta                write progress events with a number for each file, and only the fields that\n"
+      "                         have changed (as JSON with --json, or javascript with --js)\n"
+      "  --binary               write each event as a length-prefixed binary frame, with --delta progress events\n"
+      "  --retryTemplate txt    template to use when a stalled scp process is killed and retried\n"
+      "  --max-rate n           emit at most n progress events per second for each file\n"
+      "  --min-delta n          only emit progress events when the progress amount changes by n or more\n"
+      "  --parallel n           run up to n scp processes at once, one for each source file\n"
+      "  --manifest file        read source files from file (one per line), and run scp once for each\n"
+      "  --batch file           read copy operations from file (\"source destination\" on each line), and run\n"
+      "                         scp once for each, sharing one SSH connection for each destination host\n"
+      "  --ssh-command cmd      run cmd instead of ssh to open and close the --batch SSH connections\n"
+      "  --connect-timeout n    give up on a --batch SSH connection after n seconds, and copy without it (default 10)\n"
+      "  --total n              total number of bytes being copied (default: size of local source files)\n"
+      "  --command cmd          run cmd instead of scp (e.g. a wrapper script, rsync, curl or pv)\n"
+      "  --parser name          parse the progress meter of scp, rsync, curl or pv (default: from --command)\n"
+      "  --record file          save the output of each scp process to file, for --replay\n"
+      "  --replay file          process output saved by --record instead of running scp\n"
+      "  --speed n              replay n times faster than recorded, or 0 for as fast as possible (default 1)\n"
+      "  --listen [host:]port   also serve start, progress and end events to HTTP clients as Server-Sent Events\n"
+      "  --listen unix:path     (the host defaults to 127.0.0.1)\n"
+      "  --board file           publish the progress of each scp process in a memory-mapped file\n"
+      "  --stats                write counters and timings to stderr on exit (as JSON with --json)\n"
+      "  --stats-interval n     also write them every n seconds (implies --stats)\n"
+      "  --stall-timeout n      kill and retry an scp process that copies nothing for n seconds\n"
+      "  --min-speed rate       kill and retry an scp process slower than rate bytes/s (e.g. \"10KB\")\n"
+      "                         over the --stall-timeout (default 30 seconds)\n"
+      "  --retries n            retry a killed scp process up to n times (default 2)\n"
+      "  --retry-delay n        wait n seconds before the first retry, doubling for each one (default 1)\n"
+      "The following placeholders can be used in progress templates:\n"
+      "  %%f  filename\n"
+      "  %%p  progress amount (0-100)\n"
+      "  %%t  transfer size (e.g. \"2112KB\")\n"
+      "  %%s  speed (e.g. \"2.1MB/s\")\n"
+      "  %%e  ETA (e.g. \"--:--\" or \"05:23\")\n"
+      "  %%w  worker number (which scp process is copying the file, from 0)\n"
+      "  %%i  file number (from 0, incremented for each file copied)\n"
+      "  %%B  bytes copied so far, in all files\n"
+      "  %%T  total bytes to copy, or -1 if unknown\n"
+      "  %%R  overall throughput (bytes per second, smoothed)\n"
+      "  %%E  ETA for all files (seconds), or -1 if unknown\n"
+      "  %%P  progress amount for all files (0-100), or -1 if unknown\n"
+      "  %%h  destination host of the scp process (\"\" for a local destination)\n"
+      "  %%F  number of scp processes (copy operations) that have finished\n"
+      "  %%N  number of copy operations in all, or -1 if unknown\n"
+      "The following placeholders can be used in stdout/stderr templates:\n"  
+      "  %%s  text string\n"
+      "  %%w  worker number\n"
+      "  %%i  number of the file being copied by that worker, or -1\n"
+      "  %%h  destination host of that worker's scp process\n"
+      "The following placeholders can be used in the endTemplate:\n"  
+      "  %%c  exit code\n"
+      "  %%d  number of progress events dropped by --max-rate/--min-delta, because nothing changed,\n"
+      "       or because stdout was not being read quickly enough\n"
+      "  %%F  number of copy operations that finished\n"
+      "  %%N  number of copy operations in all, or -1 if unknown\n"
+      "The following placeholders can be used in the retryTemplate:\n"
+      "  %%w  worker number\n"
+      "  %%i  number of the file that was being copied, or -1\n"
+      "  %%h  destination host of the scp process\n"
+      "  %%a  attempt number of the next attempt (from 2)\n"
+      "  %%r  reason the scp process was killed (\"stalled\" or \"slow\")\n"
+      "  %%D  seconds until the next attempt\n"
+      "\n"
+      "See the 'scpwrap' and 'scp' man page for more options. Example usage:\n"
+      "  scpwrap --js -- -i identityfile user@host1:file1 user@host2:file2\n"
+      );
+      
+    // This is a program that wraps scp and prints out the numeric progress on separate lines.\n");
+    fflush(stdout);
+}
+
+
+/** restore the file status flags of stdout, which may be shared with other processes */
+void restore_stdout() {
+    if (STDOUT_FLAGS != -1) { fcntl(STDOUT_FILENO, F_SETFL, STDOUT_FLAGS); }
+}
+
+/** main */
+main(int argc, char **argv) {
+    char *startTemplate = TXT_START_TEMPLATE;
+    char *stdoutTemplate = TXT_STDOUT_TEMPLATE;
+    char *stderrTemplate = TXT_STDERR_TEMPLATE;
+    char *progressTemplate = TXT_PROGRESS_TEMPLATE;
+    char *endTemplate = TXT_END_TEMPLATE;
+    char *retryTemplate = TXT_RETRY_TEMPLATE;
+
+    char exitBuf[16];                 // exit code text
+    char suppressedBuf[24];           // suppressed progress event count text
+    struct scpwrap_field fv[MAX_FIELDS]; // field values substituted into templates
+    struct scpwrap_field jobFv[JOB_FIELDS]; // progress of all files, for the %F and %N fields
+    struct emitter em = { 0 };        // compiled templates and output buffer
+    struct coalescer co = { 0 };      // progress event coalescing options
+    double maxRate = 0, timeout, now, pollStart;
+
+    char *command = "scp";            // command to run (--command)
+    double total = -1;                // total bytes to copy (--total), or -1 to use the size of the sources
+    int parallel = 0;                 // number of concurrent scp processes in --parallel mode, or 0
+    char *manifest = NULL;            // file containing list of sources (--manifest)
+    char **sources = NULL;            // source files to copy in --parallel mode
+    int nsources = 0, sourcesSize = 0;
+    char *batch = NULL;               // file containing list of copy operations (--batch)
+    struct copy_op *ops = NULL;       // copy operations in --parallel or --batch mode
+    int nops = 0, nextOp = 0;
+    char **opts, **operands, **args = NULL; // scp options, operands, and arguments for each scp process
+    int nopts, noperands;
+    char *record = NULL;              // file to record scp output to (--record)
+    char *replay = NULL;              // file to replay scp output from (--replay)
+    FILE *replayFile;
+    double speed = 1;                 // replay speed multiplier (--speed), or 0 for as fast as possible
+
+    struct worker *workers;           // scp child processes
+    int nworkers, running = 0;        // number of workers, and number with an scp process running
+    int exitCode = 0;                 // exit code of the first scp process that failed, or -(signal number)
+    int epfd;                         // epoll instance
+    struct epoll_event events[EPOLL_MAXEVENTS], ev;
+    int nevents, stdoutEvents = 0, stdoutPollable = 1;
+    unsigned long suppressed;         // number of progress events not emitted
+    const char *text;                 // end event
+    size_t len;
+    char *listenAddr = NULL;          // address to serve events on (--listen)
+    char *board = NULL;               // file to publish progress in (--board)
+    char *parser = NULL;              // progress meter parser (--parser), or NULL to choose one from the command name
+    int i, n;
+
+    // parse options
+    int c;
+    int digit_optind = 0;
+    while (1) {
+        int this_option_optind = optind ? optind : 1;
+        int option_index = 0;
+        static struct option long_options[] = {
+            {"js",               no_argument,       0,  0 },
+            {"startTemplate",    required_argument, 0,  0 },
+            {"stdoutTemplate",   required_argument, 0,  0 },
+            {"stderrTemplate",   required_argument, 0,  0 },
+            {"progressTemplate", required_argument, 0,  0 },
+            {"endTemplate",      required_argument, 0,  0 },
+            {"json",             no_argument,       0,  0 },
+            {"max-rate",         required_argument, 0,  0 },
+            {"min-delta",        required_argument, 0,  0 },
+            {"parallel",         required_argument, 0,  0 },
+            {"manifest",         required_argument, 0,  0 },
+            {"total",            required_argument, 0,  0 },
+            {"command",          required_argument, 0,  0 },
+            {"record",           required_argument, 0,  0 },
+            {"replay",           required_argument, 0,  0 },
+            {"speed",            required_argument, 0,  0 },
+            {"listen",           required_argument, 0,  0 },
+            {"board",            required_argument, 0,  0 },
+            {"stats",            no_argument,       0,  0 },
+            {"stats-interval",   required_argument, 0,  0 },
+            {"stall-timeout",    required_argument, 0,  0 },
+            {"min-speed",        required_argument, 0,  0 },
+            {"retries",          required_argument, 0,  0 },
+            {"retry-delay",      required_argument, 0,  0 },
+            {"retryTemplate",    required_argument, 0,  0 },
+            {"parser",           required_argument, 0,  0 },
+            {"delta",            no_argument,       0,  0 },
+            {"binary",           no_argument,       0,  0 },
+            {"batch",            required_argument, 0,  0 },
+            {"ssh-command",      required_argument, 0,  0 },
+            {"connect-timeout",  required_argument, 0,  0 },
+            {0,         0,                 0,  0 }
+        };
+
+        c = getopt_long(argc, argv, "?", long_options, &option_index);
+        if (c == -1) { break; }
+        switch (c) {
+            case 0:
+                switch (option_index) {
+                    case 0: 
+                        ESCAPE_MODE = SCPWRAP_ESCAPE_JS;
+                        startTemplate = JS_START_TEMPLATE;
+                        stdoutTemplate = JS_STDOUT_TEMPLATE;
+                        stderrTemplate = JS_STDERR_TEMPLATE;
+                        progressTemplate = JS_PROGRESS_TEMPLATE;
+                        endTemplate = JS_END_TEMPLATE;
+                        retryTemplate = JS_RETRY_TEMPLATE;
+                        break;
+                    case 1: startTemplate = optarg; break;
+                    case 2: stdoutTemplate = optarg; break;
+                    case 3: stderrTemplate = optarg; break;
+                    case 4: progressTemplate = optarg; break;
+                    case 5: endTemplate = optarg; break;
+                    case 6: 
+                        ESCAPE_MODE = SCPWRAP_ESCAPE_JSON;
+                        startTemplate = JSON_START_TEMPLATE;
+                        stdoutTemplate = JSON_STDOUT_TEMPLATE;
+                        stderrTemplate = JSON_STDERR_TEMPLATE;
+                        progressTemplate = JSON_PROGRESS_TEMPLATE;
+                        endTemplate = JSON_END_TEMPLATE;
+                        retryTemplate = JSON_RETRY_TEMPLATE;
+                        break;
+                    case 7: 
+                        maxRate = atof(optarg); 
+                        if (maxRate < 0) { fprintf(stderr, "--max-rate must not be negative\n"); exit(1); }
+                        co.minInterval = maxRate == 0 ? 0 : 1 / maxRate;
+                        break;
+                    case 8: 
+                        co.minDelta = atoi(optarg); 
+                        if (co.minDelta < 0) { fprintf(stderr, "--min-delta must not be negative\n"); exit(1); }
+                        break;
+                    case 9:
+                        parallel = atoi(optarg);
+                        if (parallel < 1) { fprintf(stderr, "--parallel must be at least 1\n"); exit(1); }
+                        break;
+                    case 10: manifest = optarg; break;
+                    case 11: 
+                        total = scpwrap_parse_size(optarg); 
+                        if (total < 0) { fprintf(stderr, "--total must not be negative\n"); exit(1); }
+                        break;
+                    case 12: command = optarg; break;
+                    case 13: record = optarg; break;
+                    case 14: replay = optarg; break;
+                    case 15:
+                        speed = atof(optarg);
+                        if (speed < 0) { fprintf(stderr, "--speed must not be negative\n"); exit(1); }
+                        break;
+                    case 16: listenAddr = optarg; break;
+                    case 17: board = optarg; break;
+                    case 18: STATS_FORMAT = STATS_TEXT; break;
+                    case 19:
+                        STATS_INTERVAL = atof(optarg);
+                        if (STATS_INTERVAL <= 0) { fprintf(stderr, "--stats-interval must be greater than 0\n"); exit(1); }
+                        if (STATS_FORMAT == STATS_NONE) { STATS_FORMAT = STATS_TEXT; }
+                        break;
+                    case 20:
+                        WATCHDOG.window = atof(optarg);
+                        if (WATCHDOG.window < 0) { fprintf(stderr, "--stall-timeout must not be negative\n"); exit(1); }
+                        break;
+                    case 21:
+                        WATCHDOG.minSpeed = scpwrap_parse_size(optarg);
+                        if (WATCHDOG.minSpeed < 0) { fprintf(stderr, "--min-speed must not be negative\n"); exit(1); }
+                        break;
+                    case 22:
+                        WATCHDOG.retries = atoi(optarg);
+                        if (WATCHDOG.retries < 0) { fprintf(stderr, "--retries must not be negative\n"); exit(1); }
+                        break;
+                    case 23:
+                        WATCHDOG.retryDelay = atof(optarg);
+                        if (WATCHDOG.retryDelay < 0) { fprintf(stderr, "--retry-delay must not be negative\n"); exit(1); }
+                        break;
+                    case 24: retryTemplate = optarg; break;
+                    case 25: parser = optarg; break;
+                    case 26: if (DELTA_MODE == DELTA_NONE) { DELTA_MODE = DELTA_JSON; } break;  // set from ESCAPE_MODE below
+                    case 27: DELTA_MODE = DELTA_BINARY; break;
+                    case 28: batch = optarg; break;
+                    case 29: SSH_COMMAND = optarg; break;
+                    case 30:
+                        SSH_CONNECT_TIMEOUT = atoi(optarg);
+                        if (SSH_CONNECT_TIMEOUT < 0) { fprintf(stderr, "--connect-timeout must not be negative\n"); exit(1); }
+                        break;
+                    default:
+                        fprintf(stderr, "getopt returned option_index %d\n", option_index);
+                        exit(1);   
+                }
+                break;
+            case '?':
+                usage(); 
+                exit(1);
+                break;
+            default:
+                fprintf(stderr, "getopt returned character code 0%o '%c'\n", c, c);
+                exit(1);
+        }
+    }
+    if (replay != NULL) {
+        if (optind < argc || record != NULL || parallel > 0 || manifest != NULL || batch != NULL) {
+            fprintf(stderr, "--replay can't be used with scp options, --record, --parallel, --manifest or --batch\n");
+            exit(1);
+        }
+    } else if (batch != NULL) {
+        if (manifest != NULL) { fprintf(stderr, "--batch can't be used with --manifest\n"); exit(1); }
+    } else if (optind >= argc) {
+       fprintf(stderr, "You must supply options to 'scp' after the '--' command line-argument\n");
+       usage();
+       exit(1);
+    }
+
+    if (DELTA_MODE == DELTA_JSON) {
+        if (ESCAPE_MODE == SCPWRAP_ESCAPE_NONE) { fprintf(stderr, "--delta requires --js, --json or --binary\n"); exit(1); }
+        DELTA_MODE = ESCAPE_MODE == SCPWRAP_ESCAPE_JS ? DELTA_JS : DELTA_JSON;
+    }
+    if (parser != NULL) {
+        if ((PARSER = scpwrap_parser_find(parser)) == NULL) { 
+            fprintf(stderr, "Unknown --parser '%s'; must be one of scp, rsync, curl or pv\n", parser); 
+            exit(1); 
+        }
+    } else {
+        // e.g. "--command /usr/bin/rsync" uses the rsync parser; anything unrecognised is treated as scp
+        char *slash = strrchr(command, '/');
+        if ((PARSER = scpwrap_parser_find(slash == NULL ? command : slash + 1)) == NULL) { PARSER = scpwrap_parser_find("scp"); }
+    }
+
+    // compile templates into literal text spans and field references
+    scpwrap_arena_init(&ARENA);
+    if (scpwrap_template_compile(&em.startTpl, &ARENA, "startTemplate", startTemplate, START_PLACEHOLDERS, ALL_PLACEHOLDERS, ESCAPE_MODE) == -1 ||
+        scpwrap_template_compile(&em.stdoutTpl, &ARENA, "stdoutTemplate", stdoutTemplate, STDOUT_PLACEHOLDERS, ALL_PLACEHOLDERS, ESCAPE_MODE) == -1 ||
+        scpwrap_template_compile(&em.stderrTpl, &ARENA, "stderrTemplate", stderrTemplate, STDERR_PLACEHOLDERS, ALL_PLACEHOLDERS, ESCAPE_MODE) == -1 ||
+        scpwrap_template_compile(&em.progressTpl, &ARENA, "progressTemplate", progressTemplate, PROGRESS_PLACEHOLDERS, ALL_PLACEHOLDERS, ESCAPE_MODE) == -1 ||
+        scpwrap_template_compile(&em.endTpl, &ARENA, "endTemplate", endTemplate, END_PLACEHOLDERS, ALL_PLACEHOLDERS, ESCAPE_MODE) == -1 ||
+        scpwrap_template_compile(&em.retryTpl, &ARENA, "retryTemplate", retryTemplate, RETRY_PLACEHOLDERS, ALL_PLACEHOLDERS, ESCAPE_MODE) == -1) {
+        exit(1);
+    }
+
+    if (replay != NULL) {
+        // scp output is read from the recording, so there are no scp arguments
+        double recordedTotal;
+        char recordedParser[32];
+        if ((replayFile = replay_open(replay, &nworkers, &recordedTotal, recordedParser, sizeof(recordedParser))) == NULL) { exit(1); }
+        if (total < 0) { total = recordedTotal; }
+        // output is parsed the same way as when it was recorded, unless --parser is supplied
+        if (parser == NULL && recordedParser[0] != 0 && (PARSER = scpwrap_parser_find(recordedParser)) == NULL) {
+            fprintf(stderr, "%s was recorded with an unknown parser '%s'\n", replay, recordedParser);
+            exit(1);
+        }
+    } else {
+        // pass arguments "scp" then argv[optind] to argv[argc]
+        // argv[optind-1] should be pointing to the '--' argument so we replace it with "scp"
+        // (with --batch and no '--', it's the last option, and there are no scp options)
+        argv[optind-1] = command;
+        args = &argv[optind-1];
+        if ((manifest != NULL || batch != NULL) && parallel == 0) { parallel = 1; }
+        opts = malloc(argc * sizeof(char *));
+        operands = malloc(argc * sizeof(char *));
+        if (opts == NULL || operands == NULL) { perror("malloc"); exit(1); }
+        split_scp_args(argc - optind, &argv[optind], opts, &nopts, operands, &noperands);
+        sourcesSize = noperands;
+        sources = malloc(sourcesSize * sizeof(char *));
+        if (sources == NULL) { perror("malloc"); exit(1); }
+        for (i=0; i<noperands-1; i++) { sources[nsources++] = operands[i]; }
+        if (batch != NULL) {
+            // run a separate scp process for each line: "scp", options, [ControlPath options], source, destination
+            if (noperands > 0) {
+                fprintf(stderr, "--batch can't be used with scp source or destination files\n");
+                exit(1);
+            }
+            if (read_batch(batch, &ops, &nops) == -1) { exit(1); }
+            if (nops == 0) {
+                fprintf(stderr, "You must supply at least one copy operation in the --batch file\n");
+                exit(1);
+            }
+            sourcesSize = nops;
+            sources = realloc(sources, sourcesSize * sizeof(char *));
+            if (sources == NULL) { perror("realloc"); exit(1); }
+            for (i=0; i<nops; i++) { sources[nsources++] = ops[i].source; }
+            nworkers = parallel < nops ? parallel : nops;
+        } else if (parallel > 0) {
+            // run a separate scp process for each source: "scp", options, source, destination
+            if (noperands < 1) {
+                fprintf(stderr, "You must supply a destination to 'scp' in --parallel mode\n");
+                exit(1);
+            }
+            if (manifest != NULL && read_manifest(manifest, &sources, &nsources, &sourcesSize) == -1) { exit(1); }
+            if (nsources == 0) {
+                fprintf(stderr, "You must supply at least one source to 'scp' in --parallel mode\n");
+                exit(1);
+            }
+            nworkers = parallel < nsources ? parallel : nsources;
+            nops = nsources;
+            ops = malloc(nops * sizeof(struct copy_op));
+            if (ops == NULL) { perror("malloc"); exit(1); }
+            for (i=0; i<nops; i++) { 
+                ops[i].source = sources[i];
+                ops[i].dest = operands[noperands - 1];
+                ops[i].host = i == 0 ? host_name(ops[i].dest) : ops[0].host;
+                ops[i].master = -1;
+            }
+        } else {
+            nworkers = 1;
+        }
+    }
+
+    // total size of the files being copied, if they're all local
+    if (total < 0 && nsources > 0) {
+        total = 0;
+        for (i=0; i<nsources && total >= 0; i++) {
+            double size = source_size(sources[i]);
+            total = size < 0 ? -1 : total + size;
+        }
+    }
+    // --min-speed on its own measures speed over the default window
+    if (WATCHDOG.minSpeed > 0 && WATCHDOG.window == 0) { WATCHDOG.window = WATCHDOG_WINDOW; }
+    em.job.total = total;
+    em.job.rate = -1;
+    em.job.copies = replay != NULL ? -1 : (parallel > 0 ? nops : 1);
+    // recordings are replayed in the time they were recorded in, starting from 0
+    em.job.sampleTime = replay != NULL ? 0 : now_secs();
+
+    workers = scpwrap_arena_alloc(&ARENA, nworkers * sizeof(struct worker));
+    if (workers == NULL) { perror("malloc"); exit(1); }
+    memset(workers, 0, nworkers * sizeof(struct worker));
+    for (i=0; i<nworkers; i++) {
+        workers[i].id = i;
+        scpwrap_arena_init(&workers[i].arena);
+        workers[i].co = co;
+        workers[i].co.last.arena = workers[i].co.pending.arena = workers[i].delta.arena = &workers[i].arena;
+        workers[i].idLen = sprintf(workers[i].idText, "%d", i);
+        workers[i].fileId = -1;
+        workers[i].fileIdLen = sprintf(workers[i].fileIdText, "%d", -1);
+        workers[i].host = "";
+        if (parallel > 0) {
+            // set by worker_op() for each copy operation
+            workers[i].args = scpwrap_arena_alloc(&ARENA, (nopts + 8) * sizeof(char *));
+            if (workers[i].args == NULL) { perror("malloc"); exit(1); }
+            workers[i].args[0] = command;
+            memcpy(&workers[i].args[1], opts, nopts * sizeof(char *));
+        } else {
+            workers[i].args = args;
+            if (replay == NULL && noperands > 0) { workers[i].host = host_name(operands[noperands - 1]); }
+        }
+        workers[i].hostLen = strlen(workers[i].host);
+        workers[i].em = &em;
+        if (scpwrap_stream_init(&workers[i].stream, &workers[i].arena, PARSER, worker_event, &workers[i]) == -1) {
+            perror("malloc"); exit(1);
+        }
+    }
+    if (record != NULL) { record_open(record, nworkers, total, PARSER->name, em.job.sampleTime); }
+    if (board != NULL) { board_open(board, nworkers, total); }
+    if (STATS_FORMAT != STATS_NONE) {
+        if (ESCAPE_MODE == SCPWRAP_ESCAPE_JSON) { STATS_FORMAT = STATS_JSON; }
+        STATS.startTime = now_secs();
+        if (STATS_INTERVAL > 0) { STATS.nextReport = STATS.startTime + STATS_INTERVAL; }
+    }
+    em.sse.listenFd = -1;
+    if (listenAddr != NULL && sse_listen(&em.sse, listenAddr, nworkers) == -1) { exit(1); }
+
+    STDOUT_FLAGS = fcntl(STDOUT_FILENO, F_GETFL);
+    if (outq_init(&em.q, &ARENA, STDOUT_FILENO) == -1) { perror("malloc"); exit(1); }
+    em.q.framed = DELTA_MODE == DELTA_BINARY;
+    if (DELTA_MODE != DELTA_NONE && scpwrap_outbuf_init(&em.sseBuf, &ARENA, STDOUT_BUFSIZE) == -1) { perror("malloc"); exit(1); }
+    atexit(restore_stdout);
+
+    if (replay != NULL) {
+        exitCode = replay_run(&em, workers, nworkers, replayFile, speed);
+    } else {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd == -1) { perror("epoll_create1"); exit(1); }
+        // stdout is only watched while there's output waiting to be written to it. Regular files 
+        // can't be added to an epoll instance, but are always writable anyway
+        ev.events = 0;
+        ev.data.u32 = EPOLL_STDOUT;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDOUT_FILENO, &ev) == -1) { stdoutPollable = 0; }
+        if (em.sse.listenFd != -1) {
+            ev.events = EPOLLIN;
+            ev.data.u32 = EPOLL_SSE;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, em.sse.epfd, &ev);
+        }
+
+        if (batch != NULL) { masters_open(opts, nopts); }
+
+        // start the first scp process for each worker; each subsequent copy operation is 
+        // taken by whichever worker finishes first
+        for (i=0; i<nworkers; i++) {
+            if (parallel > 0) { worker_op(&workers[i], &ops[nextOp++], nopts + 1); }
+            workers[i].attempt = 1;
+            if (worker_start(&workers[i], epfd) == -1) { exit(1); }
+            if (BOARD != NULL) { board_worker(&em.job, &workers[i], BOARD_RUNNING); }
+            running++;
+        }
+    }
+
+    while (running > 0) {
+        // if stdout can't keep up with us, stop reading until it does
+        if (outq_full(&em.q)) { outq_drain(&em.q, OUTQ_MAXSIZE / 2); }
+        if (outq_pending(&em.q) && !stdoutPollable) { outq_write(&em.q); }
+        sse_flush(&em.sse);
+        if (stdoutPollable && stdoutEvents != (outq_pending(&em.q) ? EPOLLOUT : 0)) {
+            stdoutEvents = ev.events = outq_pending(&em.q) ? EPOLLOUT : 0;
+            ev.data.u32 = EPOLL_STDOUT;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, STDOUT_FILENO, &ev);
+        }
+
+        // wake up when a coalesced progress event becomes due
+        now = now_secs();
+        timeout = -1;
+        for (i=0; i<nworkers; i++) {
+            double t = coalesce_timeout(&workers[i].co, now);
+            if (t >= 0 && (timeout < 0 || t < timeout)) { timeout = t; }
+            t = watchdog_timeout(&workers[i], now);
+            if (t >= 0 && (timeout < 0 || t < timeout)) { timeout = t; }
+        }
+        if (STATS.nextReport > 0 && (timeout < 0 || STATS.nextReport - now < timeout)) {
+            timeout = STATS.nextReport - now < 0 ? 0 : STATS.nextReport - now;
+        }
+
+        pollStart = now;
+        nevents = epoll_wait(epfd, events, EPOLL_MAXEVENTS, timeout < 0 ? -1 : (int) (timeout * 1000) + 1);
+        STATS.polls++;
+        if (nevents == -1) { 
+            if (errno == EINTR) { continue; }
+            perror("epoll_wait()"); exit(1);
+        }
+        now = now_secs();
+        em.q.inputTime = now;
+        if (STATS_FORMAT != STATS_NONE) {
+            STATS.pollTime += now - pollStart;
+            if (STATS.nextReport > 0 && now >= STATS.nextReport) { stats_report(&em, workers, nworkers, 0, now); }
+        }
+        for (i=0; i<nworkers; i++) {
+            if (coalesce_timeout(&workers[i].co, now) == 0) { worker_flush(&em, &workers[i], now, 0); }
+            if (watchdog_check(&em, &workers[i], epfd, now) == -1) {
+                // the retry couldn't be started, so the copy has failed; take the next copy operation
+                running--;
+                em.job.copiesFinished++;
+                em.job.textValid = 0;
+                if (exitCode == 0) { exitCode = workers[i].exitCode; }
+                running += worker_next(&em, &workers[i], ops, nops, &nextOp, nopts + 1, epfd, &exitCode);
+            }
+        }
+
+        for (n=0; n<nevents; n++) {
+            struct worker *w;
+            if (events[n].data.u32 == EPOLL_STDOUT) {
+                // the error and hangup events are reported even while stdout isn't being 
+                // watched, so stop watching it once it can't be written to
+                if (events[n].events & (EPOLLERR | EPOLLHUP)) { outq_fail(&em.q); } else { outq_write(&em.q); }
+                if (em.q.error) { 
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, STDOUT_FILENO, NULL);
+                    stdoutPollable = 0;
+                }
+                continue;
+            } else if (events[n].data.u32 == EPOLL_SSE) {
+                sse_service(&em.sse);
+                continue;
+            }
+            w = &workers[events[n].data.u32 / 2];
+            if (w->pid == 0 || !worker_read(&em, w, events[n].data.u32 % 2, now)) { continue; }
+
+            // both stdout & stderr have been closed
+ 
+            worker_finish(&em, w, now);
+            if (worker_retry(&em, w, now)) { continue; }  // restarted by watchdog_check() later
+            running--;
+            em.job.copiesFinished++;
+            em.job.textValid = 0;
+            if (w->exitCode != 0 && exitCode == 0) { exitCode = w->exitCode; }
+            // take the next copy operation
+            running += worker_next(&em, w, ops, nops, &nextOp, nopts + 1, epfd, &exitCode);
+        }
+    }
+
+    if (BOARD != NULL) {
+        board_begin(BOARD);
+        BOARD->finished = 1;
+        BOARD->exitCode = exitCode;
+        board_end(BOARD);
+    }
+
+    suppressed = em.q.replaced;
+    for (i=0; i<nworkers; i++) { suppressed += workers[i].co.received - workers[i].co.emitted; }
+    fv[0].str = exitBuf; fv[0].len = sprintf(exitBuf, "%d", exitCode);
+    fv[1].str = suppressedBuf; fv[1].len = sprintf(suppressedBuf, "%lu", suppressed);
+    em.job.textValid = 0;
+    job_fields(&em.job, jobFv);
+    fv[2] = jobFv[5];
+    fv[3] = jobFv[6];
+    if (STATS_FORMAT != STATS_NONE) { em.q.inputTime = now_secs(); }
+    scpwrap_template_render(outq_begin(&em.q), &em.endTpl, fv);
+    text = outq_rendered(&em.q, &len);
+    sse_publish(&em.sse, SSE_END, 0, text, len);
+    outq_commit(&em.q, -1);
+    outq_drain(&em.q, 0);
+    sse_close(&em.sse, SSE_LINGER);
+    if (STATS_FORMAT != STATS_NONE) { stats_report(&em, workers, nworkers, 1, now_secs()); }
+    if (em.q.error) {
+        fprintf(stderr, "Output was lost: stdout could not be written to\n");
+        if (exitCode == 0) { exitCode = 1; }
+    }
+    if (RECORD_FILE != NULL && fclose(RECORD_FILE) == EOF) {
+        perror(record);
+        if (exitCode == 0) { exitCode = 1; }
+    }
+
+    // propagate exitStatus; a signal is displayed as -(signal number) but exits with 1
+    exit (exitCode < 0 ? 1 : exitCode);
+}
@@ -0,0 +1,72 @@
+/* alloccount.c
+ *
+ * $Id$
+ *
+ * Counts heap allocations, used by test-alloc.sh to check that scpwrap's allocations
+ * don't depend on how much output scp writes. Load it with
+ * "ALLOCCOUNT=file LD_PRELOAD=tests/alloccount.so scpwrap ...", and the number of calls to
+ * malloc(), calloc(), realloc(), posix_memalign() and aligned_alloc() is written to file
+ * when the process exits. strdup(), getline() and stdio allocate through malloc(), so they
+ * are counted as well.
+ *
+ * LD_PRELOAD is removed from the environment on startup, so that scp (and anything else
+ * scpwrap runs) isn't counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long ALLOCS = 0;
+static const char *FILENAME = NULL;
+
+void *malloc(size_t size) {
+    ALLOCS++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    ALLOCS++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    ALLOCS++;
+    return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    ALLOCS++;
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == NULL ? ENOMEM : 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    ALLOCS++;
+    return __libc_memalign(alignment, size);
+}
+
+__attribute__((constructor)) static void alloccount_start(void) {
+    FILENAME = getenv("ALLOCCOUNT");
+    unsetenv("LD_PRELOAD");
+    ALLOCS = 0;
+}
+
+__attribute__((destructor)) static void alloccount_end(void) {
+    char buf[32];
+    int fd, len;
+    if (FILENAME == NULL) { return; }
+    fd = open(FILENAME, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) { return; }
+    len = snprintf(buf, sizeof(buf), "%lu\n", ALLOCS);
+    write(fd, buf, len);
+    close(fd);
+}
@@ -0,0 +1,49 @@
+/* cplusplus.cpp
+ *
+ * $Id$
+ *
+ * Checks that libscpwrap.h, scpwrap-board.h and scpwrap-delta.h can be included from C++,
+ * and that a C++ program links against libscpwrap.a. Parses a line of scp output and
+ * exits non-zero if no progress event is received.
+ *
+ * usage: tests/cplusplus
+ */
+
+#include <cstdio>
+#include <cstring>
+#include "../libscpwrap.h"
+#include "../scpwrap-board.h"
+#include "../scpwrap-delta.h"
+
+static int PROGRESS_EVENTS = 0;
+
+static void on_event(void *ctx, const struct scpwrap_event *ev) {
+    (void) ctx;
+    if (ev->type == SCPWRAP_EVENT_PROGRESS && 
+        strcmp(ev->progress->fv[SCPWRAP_FIELD_FILENAME].str, "file.txt") == 0) {
+        PROGRESS_EVENTS++;
+    }
+}
+
+int main() {
+    static const char *LINE = "\rfile.txt                                       50%  512KB 512.0KB/s   00:01 ETA";
+    const char *args[] = { "scp", "file.txt", "host:", NULL };
+    struct scpwrap_stream s;
+    const unsigned char *p = NULL;
+    uint64_t n;
+
+    if (scpwrap_stream_init(&s, NULL, scpwrap_parser_find("scp"), on_event, NULL) == -1) { 
+        perror("scpwrap_stream_init"); return 1; 
+    }
+    scpwrap_stream_start(&s, (char **) args);
+    scpwrap_stream_feed(&s, 0, LINE, strlen(LINE));
+    scpwrap_stream_close(&s, 0);
+    scpwrap_stream_close(&s, 1);
+    // the inline functions in the other headers are compiled as C++ as well
+    if (board_size(0) != sizeof(struct board_header) || delta_varint(&p, p, &n) != -1) {
+        fprintf(stderr, "cplusplus: unexpected board_size() or delta_varint() result\n"); return 1;
+    }
+    if (PROGRESS_EVENTS == 0) { fprintf(stderr, "cplusplus: no progress events\n"); return 1; }
+    printf("cplusplus: ok\n");
+    return 0;
+}
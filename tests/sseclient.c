@@ -0,0 +1,68 @@
+/* sseclient.c
+ *
+ * $Id$
+ *
+ * Minimal client for scpwrap's --listen server, used by test-alloc.sh and test-sse.sh.
+ * Connects to a unix socket, retrying for up to 5 seconds until scpwrap has created it,
+ * requests the event stream and reads it until scpwrap closes the connection. The number
+ * of bytes read is written to stdout.
+ *
+ * usage: sseclient [-s usecs] [-o file] path
+ *
+ * Options are:
+ *   -s usecs   read at most 4096 bytes at a time, sleeping for usecs microseconds after
+ *              each read, to act as a client that can't keep up (default 0)
+ *   -o file    write the response to file
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+int main(int argc, char *argv[]) {
+    static const char *REQUEST = "GET / HTTP/1.0\r\n\r\n";
+    struct sockaddr_un sun = { 0 };
+    char buf[65536];
+    unsigned long long total = 0;
+    ssize_t n;
+    size_t bufSize = sizeof(buf);
+    FILE *out = NULL;
+    int fd, i, c, sleepTime = 0;
+
+    while ((c = getopt(argc, argv, "s:o:")) != -1) {
+        switch (c) {
+            case 's': sleepTime = atoi(optarg); bufSize = 4096; break;
+            case 'o': 
+                out = fopen(optarg, "w"); 
+                if (out == NULL) { perror(optarg); return 1; }
+                break;
+            default: fprintf(stderr, "usage: sseclient [-s usecs] [-o file] path\n"); return 1;
+        }
+    }
+    if (optind != argc - 1 || strlen(argv[optind]) >= sizeof(sun.sun_path)) { 
+        fprintf(stderr, "usage: sseclient [-s usecs] [-o file] path\n"); return 1; 
+    }
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, argv[optind]);
+    for (i=0; i<500; i++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) { perror("socket"); return 1; }
+        if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) == 0) { break; }
+        close(fd);
+        fd = -1;
+        usleep(10000);
+    }
+    if (fd == -1) { perror(argv[optind]); return 1; }
+    if (write(fd, REQUEST, strlen(REQUEST)) == -1) { perror("write"); return 1; }
+    while ((n = read(fd, buf, bufSize)) > 0) { 
+        total += n; 
+        if (out != NULL) { fwrite(buf, 1, n, out); }
+        if (sleepTime > 0) { usleep(sleepTime); }
+    }
+    if (out != NULL) { fclose(out); }
+    printf("%llu\n", total);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Checks that the number of heap allocations scpwrap makes doesn't depend on how many
+# progress lines scp writes, by running bench/fakescp with 1000 and then 100000 lines
+# in each output mode and counting allocations with tests/alloccount.so
+#
+# usage: tests/test-alloc.sh (from the top-level directory, after make)
+
+set -e
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# allocs name lines scpwrap-options...
+# writes the number of allocations made by scpwrap to $tmp/name.lines
+allocs() {
+    name=$1; lines=$2; shift 2
+    ALLOCCOUNT="$tmp/$name.$lines" LD_PRELOAD=tests/alloccount.so \
+        ./scpwrap "$@" --command bench/fakescp -- -n $lines -f 40 -e 100 > /dev/null 2>&1
+}
+
+# check name scpwrap-options...
+check() {
+    name=$1; shift
+    allocs $name 1000 "$@"
+    allocs $name 100000 "$@"
+    if ! cmp -s "$tmp/$name.1000" "$tmp/$name.100000"; then
+        echo "test-alloc: $name: $(cat "$tmp/$name.1000") allocations for 1000 lines, $(cat "$tmp/$name.100000") for 100000"
+        failed=1
+    fi
+}
+
+check text
+check text-unlimited --max-rate 0
+check json --json
+check json-unlimited --json --max-rate 0
+check delta --json --delta --max-rate 0
+check binary --binary --max-rate 0
+check record --json --max-rate 0 --record "$tmp/recording"
+
+# --listen, with a client connected for the whole run; slowscp waits for the client to connect
+for lines in 1000 100000; do
+    tests/sseclient "$tmp/sse.sock" > "$tmp/sse-bytes.$lines" &
+    ALLOCCOUNT="$tmp/sse.$lines" LD_PRELOAD=tests/alloccount.so \
+        ./scpwrap --json --max-rate 0 --listen "unix:$tmp/sse.sock" \
+        --command tests/slowscp -- -n $lines -f 40 -e 100 > /dev/null 2>&1
+    wait $!
+    if [ ! -s "$tmp/sse-bytes.$lines" ] || [ "$(cat "$tmp/sse-bytes.$lines")" -eq 0 ]; then
+        echo "test-alloc: sse: the client wasn't sent any events"; failed=1
+    fi
+done
+if ! cmp -s "$tmp/sse.1000" "$tmp/sse.100000"; then
+    echo "test-alloc: sse: $(cat "$tmp/sse.1000") allocations for 1000 lines, $(cat "$tmp/sse.100000") for 100000"
+    failed=1
+fi
+
+if [ $failed -ne 0 ]; then exit 1; fi
+echo "test-alloc: ok"
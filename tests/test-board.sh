@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Checks that scpwrap-board displays a --board file, and gives up on one that was
+# left part way through an update (as if scpwrap had crashed during it)
+#
+# usage: tests/test-board.sh (from the top-level directory, after make)
+
+set -e
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+./scpwrap --board "$tmp/board" --command tests/utf8scp -- src host:dest > /dev/null
+if ! ./scpwrap-board "$tmp/board" | grep -q '^pid [0-9]*: finished (exit code 0)'; then
+    echo "test-board: scpwrap-board didn't display the board"; ./scpwrap-board "$tmp/board"; exit 1
+fi
+
+# set the seqlock sequence number (after the 8-byte magic, version and nslots) to 1
+printf '\001\000\000\000' | dd of="$tmp/board" bs=1 seek=16 conv=notrunc 2> /dev/null
+if timeout 30 ./scpwrap-board "$tmp/board" > /dev/null 2> "$tmp/err"; then
+    echo "test-board: scpwrap-board displayed a board that was part way through an update"; exit 1
+fi
+if ! grep -q 'part way through an update' "$tmp/err"; then
+    echo "test-board: scpwrap-board didn't give up on a board that was part way through an update"; cat "$tmp/err"; exit 1
+fi
+echo "test-board: ok"
@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Checks that "scpwrap --binary | scpwrap-decode" writes the same progress events
+# as "scpwrap --json", including filenames that aren't valid UTF-8
+#
+# usage: tests/test-decode.sh (from the top-level directory, after make)
+
+set -e
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+./scpwrap --json --max-rate 0 --command tests/utf8scp -- src host:dest | grep '"event":"progress"' > "$tmp/json"
+./scpwrap --binary --max-rate 0 --command tests/utf8scp -- src host:dest | ./scpwrap-decode > "$tmp/decoded"
+
+if ! grep -q 'caf\\u00e9-\\u20ac.txt' "$tmp/json"; then
+    echo "test-decode: --json didn't escape the non-ASCII filename"; cat "$tmp/json"; exit 1
+fi
+if LC_ALL=C grep -q "$(printf '\377')" "$tmp/decoded"; then
+    echo "test-decode: scpwrap-decode wrote malformed UTF-8"; exit 1
+fi
+if ! cmp -s "$tmp/json" "$tmp/decoded"; then
+    echo "test-decode: decoded --binary output differs from --json"
+    diff "$tmp/json" "$tmp/decoded" || true
+    exit 1
+fi
+echo "test-decode: ok ($(wc -l < "$tmp/json") progress events)"
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Checks that a --listen client that can't keep up is still sent whole SSE frames,
+# when scpwrap drops the events it hasn't read and sends it the current state instead
+#
+# usage: tests/test-sse.sh (from the top-level directory, after make)
+
+set -e
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+tests/sseclient -s 2000 -o "$tmp/stream" "$tmp/sse.sock" > /dev/null &
+./scpwrap --json --max-rate 0 --listen "unix:$tmp/sse.sock" \
+    --command tests/slowscp -- -n 300000 -f 200 > /dev/null 2>&1
+wait $!
+
+# the connection is closed after SSE_LINGER seconds, so the last frame may be incomplete
+sed '1,/^\r$/d; $d' "$tmp/stream" > "$tmp/frames"
+if [ $(grep -c '"event":"start"' "$tmp/frames") -lt 2 ]; then
+    echo "test-sse: the client didn't fall behind and get resynchronised"; exit 1
+fi
+if grep -v '^$' "$tmp/frames" | grep -v -q '^data: {"event":"[a-z]*".*}$' || grep -q 'data:.*data:' "$tmp/frames"; then
+    echo "test-sse: the client was sent incomplete frames"
+    grep -v '^$' "$tmp/frames" | grep -v '^data: {"event":"[a-z]*".*}$' | head -3
+    grep 'data:.*data:' "$tmp/frames" | head -3
+    exit 1
+fi
+echo "test-sse: ok ($(grep -c '^data:' "$tmp/frames") events)"